@@ -24,6 +24,9 @@ typedef enum {
     OP_GREATER,
     OP_LESS,
     OP_ADD,
+    OP_ADD_NUMBER,      // OP_ADD quickened after seeing two numbers
+    OP_ADD_STRING,      // OP_ADD quickened after seeing two strings
+    OP_ADD_GENERIC,     // OP_ADD at a site that saw both, so it isn't quickened again
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
@@ -32,8 +35,13 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_NOT_LESS,            // <, OP_JUMP_IF_FALSE, OP_POP
+    OP_JUMP_IF_NOT_LESS_EQUAL,      // >, OP_NOT, OP_JUMP_IF_FALSE, OP_POP
+    OP_JUMP_IF_NOT_GREATER,         // >, OP_JUMP_IF_FALSE, OP_POP
+    OP_JUMP_IF_NOT_GREATER_EQUAL,   // <, OP_NOT, OP_JUMP_IF_FALSE, OP_POP
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,                   // OP_CALL whose result is returned straight away
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
@@ -42,19 +50,65 @@ typedef enum {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+
+    // superinstructions (fused by the compiler).
+    OP_ADD_LOCALS,                  // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+    OP_GET_LOCAL_PROPERTY,          // OP_GET_LOCAL, OP_GET_PROPERTY
+    OP_JUMP_IF_NOT_LESS_CONSTANT,   // OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP
+
+    // three-address register instructions: local dst = local a <op> local b
+    // (RR) or local a <op> constant b (RK), without touching the stack.
+    OP_ADD_RR,
+    OP_SUBTRACT_RR,
+    OP_MULTIPLY_RR,
+    OP_DIVIDE_RR,
+    OP_ADD_RK,
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
 } OpCode;
 
+struct ObjClass;
+struct ObjClosure;
+struct ObjShape;
+
+// number of receiver types a property or invoke site remembers before it
+// gives up and goes megamorphic.
+#define INLINE_CACHE_SIZE 4
+#define CACHE_MEGAMORPHIC -1
+
+// what a property name resolved to for one receiver type.
+typedef struct {
+    struct ObjShape* shape;     // receiver layout.
+    struct ObjClass* klass;     // receiver class.
+    struct ObjShape* target;    // layout after storing (set sites only).
+    int slot;                   // field index, or -1 if the name is a method.
+    struct ObjClosure* method;  // the method when slot is -1.
+} CacheEntry;
+
+// inline cache for a single property access or invoke instruction.
+typedef struct {
+    uint32_t epoch;             // vm.methodEpoch when the entries were filled.
+    int count;                  // entries in use, or CACHE_MEGAMORPHIC.
+    CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    InlineCache* caches;
+    int cacheCount;
+    int cacheCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -11,6 +11,32 @@
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+
+// compile arithmetic assigned to a local to three-address register
+// instructions. Turn off to compare against the plain stack code.
+#define REGISTER_OPS
+
+// compile hot functions to native code. The templates are x86-64 and
+// assume NaN boxing; everywhere else the interpreter runs alone.
+#if defined(NAN_BOXING) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT
+#endif
+
+// mark large heaps on several threads. Stress testing the collector keeps
+// it on one, so every collection runs the same way.
+#if !defined(DEBUG_STRESS_GC) && (defined(__GNUC__) || defined(__clang__)) && (defined(__unix__) || defined(__APPLE__))
+#define PARALLEL_MARK
+#endif
+
+// run the peephole optimizer over each chunk once it has been compiled.
+#define OPTIMIZE_CODE
+
+// dispatch run() with computed gotos (direct threading) where the compiler
+// supports "labels as values". Other compilers fall back to the switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
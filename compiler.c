@@ -5,6 +5,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -71,6 +72,19 @@ typedef struct Compiler {
     int localCount;                 // count of local variables
     Upvalue upvalues[UINT8_COUNT];  // array of upvalues
     int scopeDepth;                 // how deep are we?
+
+    // where recent instructions start, so the tail of the chunk can be
+    // fused into superinstructions as it is emitted.
+    int lastLocalGet;               // last OP_GET_LOCAL
+    int prevLocalGet;               // OP_GET_LOCAL before that
+    int lastConstant;               // last OP_CONSTANT
+    int lastLiteral;                // last OP_CONSTANT, OP_NIL, OP_TRUE or OP_FALSE
+    int lastComparison;             // last <, >, <= or >= comparison
+    int lastArithmetic;             // last OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE or OP_ADD_LOCALS
+    int lastLocalSet;               // last OP_SET_LOCAL
+    int lastCall;                   // last OP_CALL
+    uint8_t comparisonJump;         // the fused jump that replaces it
+    int jumpTarget;                 // latest jump destination; code before it can't be fused
 } Compiler;
 
 // the class being compiled
@@ -168,6 +182,28 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte( byte2);
 }
 
+// emit a global variable instruction with its two-byte slot operand.
+// Arguments:
+//  instruction - the global instruction.
+//  slot - index of the global in vm.globalValues.
+static void emitGlobal(uint8_t instruction, int slot) {
+    emitByte(instruction);
+    emitByte((slot >> 8) & 0xff);
+    emitByte(slot & 0xff);
+}
+
+// add an inline cache to the current chunk and emit its two-byte index.
+static void emitCache() {
+    int cache = addInlineCache(currentChunk());
+
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
 // emit a loop instruction (jump back to the beginning of the loop).
 // Arguments: loopStart - offset to the start of the loop.
 static void emitLoop(int loopStart) {
@@ -180,6 +216,14 @@ static void emitLoop(int loopStart) {
     emitByte(offset & 0xff);
 }
 
+// record that the current end of the chunk is a jump destination, so
+// nothing emitted before it gets fused with what comes after.
+// Returns: the offset of the destination.
+static int markJumpTarget() {
+    current->jumpTarget = currentChunk()->count;
+    return current->jumpTarget;
+}
+
 // emit a jump instruction with a placeholder operand.
 // Arguments: instruction - the actual jump instruction.
 // Returns: the start of the placeholder.
@@ -218,9 +262,25 @@ static uint8_t makeConstant(Value value) {
 // emit a constant.
 // Arguments: value - the number.
 static void emitConstant(Value value) {
+    current->lastConstant = currentChunk()->count;
+    current->lastLiteral = currentChunk()->count;
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+// emit a literal value, using OP_NIL, OP_TRUE and OP_FALSE where possible.
+// Arguments: value - the value.
+static void emitLiteral(Value value) {
+    if (IS_NIL(value)) {
+        current->lastLiteral = currentChunk()->count;
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        current->lastLiteral = currentChunk()->count;
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
 // patch the jump operand with an actual distance to jump.
 // Arguments: offset - the actual number of bytes to jump.
 static void patchJump(int offset) {
@@ -233,6 +293,203 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    markJumpTarget();
+}
+
+// fuse "OP_GET_LOCAL a, OP_GET_LOCAL b" at the end of the chunk with the
+// OP_ADD about to be emitted into a single OP_ADD_LOCALS a b.
+// Returns: true if fused, false if the OP_ADD still needs emitting.
+static bool fuseAddLocals() {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count - 4;
+    if (current->lastLocalGet != chunk->count - 2 || current->prevLocalGet != start ||
+        current->jumpTarget > start) {
+        return false;
+    }
+
+    chunk->code[start] = OP_ADD_LOCALS;
+    chunk->code[start + 2] = chunk->code[start + 3];
+    chunk->count--;
+    current->lastLocalGet = -1;
+    current->prevLocalGet = -1;
+    return true;
+}
+
+// fuse an OP_GET_LOCAL at the end of the chunk with the OP_GET_PROPERTY
+// about to be emitted into a single OP_GET_LOCAL_PROPERTY. The local's slot
+// operand stays where it is; the property operands follow it.
+// Returns: true if fused, false if the OP_GET_PROPERTY still needs emitting.
+static bool fuseGetLocalProperty() {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count - 2;
+    if (current->lastLocalGet != start || current->jumpTarget > start) {
+        return false;
+    }
+
+    chunk->code[start] = OP_GET_LOCAL_PROPERTY;
+    current->lastLocalGet = -1;
+    current->prevLocalGet = -1;
+    return true;
+}
+
+// forget the recent instructions, after the code they point into has been
+// thrown away.
+static void resetFusion() {
+    current->lastLocalGet = -1;
+    current->prevLocalGet = -1;
+    current->lastConstant = -1;
+    current->lastLiteral = -1;
+    current->lastComparison = -1;
+    current->lastArithmetic = -1;
+    current->lastLocalSet = -1;
+    current->lastCall = -1;
+}
+
+// length of a literal instruction.
+// Arguments: instruction - the opcode.
+// Returns: the length in bytes, or 0 if it's not a literal.
+static int literalLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+            return 2;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// find the literal the chunk ends with, so it can be folded.
+// Returns: the offset of the literal, or -1 if the chunk doesn't end with one.
+static int tailLiteral() {
+    Chunk* chunk = currentChunk();
+    int start = current->lastLiteral;
+    if (start == -1 || start >= chunk->count || current->jumpTarget > start) return -1;
+
+    int length = literalLength(chunk->code[start]);
+    if (length == 0 || start + length != chunk->count) return -1;
+    return start;
+}
+
+// the value a literal instruction pushes.
+// Arguments: offset - the offset of the literal.
+static Value literalValue(int offset) {
+    Chunk* chunk = currentChunk();
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+            return chunk->constants.values[chunk->code[offset + 1]];
+        case OP_TRUE:
+            return BOOL_VAL(true);
+        case OP_FALSE:
+            return BOOL_VAL(false);
+        default:
+            return NIL_VAL;
+    }
+}
+
+// remove the literal at the end of the chunk. Its constant is dropped from
+// the pool too if nothing was added after it.
+// Arguments: offset - the offset of the literal.
+static void removeLiteral(int offset) {
+    Chunk* chunk = currentChunk();
+    if (chunk->code[offset] == OP_CONSTANT &&
+        chunk->code[offset + 1] == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    chunk->count = offset;
+    current->lastLiteral = -1;
+    current->lastConstant = -1;
+}
+
+// is a literal value false in a condition? nil and false are, everything else isn't.
+static bool literalFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// if the condition just compiled is a literal, remove it so the caller can
+// compile only the branch that will be taken.
+// Arguments: truthy - set to whether the condition is always true.
+// Returns: whether the condition was a literal.
+static bool constantCondition(bool* truthy) {
+    int start = tailLiteral();
+    if (start == -1) return false;
+
+    *truthy = !literalFalsey(literalValue(start));
+    removeLiteral(start);
+    return true;
+}
+
+#ifdef REGISTER_OPS
+// the register instruction for an arithmetic instruction.
+// Arguments:
+//  instruction - OP_ADD, OP_SUBTRACT, OP_MULTIPLY or OP_DIVIDE.
+//  constant - whether the second operand is a constant (RK) or a local (RR).
+static uint8_t registerInstruction(uint8_t instruction, bool constant) {
+    switch (instruction) {
+        case OP_ADD:      return constant ? OP_ADD_RK : OP_ADD_RR;
+        case OP_SUBTRACT: return constant ? OP_SUBTRACT_RK : OP_SUBTRACT_RR;
+        case OP_MULTIPLY: return constant ? OP_MULTIPLY_RK : OP_MULTIPLY_RR;
+        default:          return constant ? OP_DIVIDE_RK : OP_DIVIDE_RR;
+    }
+}
+
+// fuse arithmetic on locals that is stored into a local, at the end of an
+// expression statement, with the OP_POP about to be emitted into a single
+// three-address instruction that never touches the stack:
+//  OP_ADD_LOCALS a b, OP_SET_LOCAL dst, OP_POP                  -> OP_ADD_RR dst a b
+//  OP_GET_LOCAL a, OP_GET_LOCAL b, op, OP_SET_LOCAL dst, OP_POP -> op_RR dst a b
+//  OP_GET_LOCAL a, OP_CONSTANT b, op, OP_SET_LOCAL dst, OP_POP  -> op_RK dst a b
+// Returns: true if fused, false if the OP_POP still needs emitting.
+static bool fuseRegisterStore() {
+    Chunk* chunk = currentChunk();
+    int set = chunk->count - 2;
+    int op = current->lastArithmetic;
+    if (current->lastLocalSet != set || op == -1) return false;
+
+    uint8_t instruction;
+    int start;
+    uint8_t a, b;
+    if (chunk->code[op] == OP_ADD_LOCALS && op + 3 == set) {
+        instruction = OP_ADD_RR;
+        start = op;
+        a = chunk->code[op + 1];
+        b = chunk->code[op + 2];
+    } else if (op + 1 != set || op < 4) {
+        return false;
+    } else if (current->lastLocalGet == op - 2 && current->prevLocalGet == op - 4) {
+        instruction = registerInstruction(chunk->code[op], false);
+        start = op - 4;
+        a = chunk->code[start + 1];
+        b = chunk->code[start + 3];
+    } else if (current->lastConstant == op - 2 && current->lastLocalGet == op - 4) {
+        instruction = registerInstruction(chunk->code[op], true);
+        start = op - 4;
+        a = chunk->code[start + 1];
+        b = chunk->code[start + 3];
+    } else {
+        return false;
+    }
+    if (current->jumpTarget > start || chunk->code[start] != (start == op ? OP_ADD_LOCALS : OP_GET_LOCAL)) {
+        return false;
+    }
+
+    uint8_t dst = chunk->code[set + 1];
+    chunk->count = start;
+    resetFusion();
+    emitBytes(instruction, dst);
+    emitBytes(a, b);
+    return true;
+}
+#endif
+
+// emit the OP_POP that discards the value of an expression statement.
+static void emitExpressionPop() {
+#ifdef REGISTER_OPS
+    if (fuseRegisterStore()) return;
+#endif
+    emitByte(OP_POP);
 }
 
 // initialize a compiler.
@@ -243,6 +500,16 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastLocalGet = -1;
+    compiler->prevLocalGet = -1;
+    compiler->lastConstant = -1;
+    compiler->lastLiteral = -1;
+    compiler->lastComparison = -1;
+    compiler->lastArithmetic = -1;
+    compiler->lastLocalSet = -1;
+    compiler->lastCall = -1;
+    compiler->comparisonJump = OP_JUMP_IF_FALSE;
+    compiler->jumpTarget = 0;
     compiler->function = newFunction();
     current = compiler;
 
@@ -267,13 +534,28 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+#ifdef DEBUG_PRINT_CODE
+    const char* name = function->name != NULL ? function->name->chars : "<script>";
+#endif
+
+#ifdef OPTIMIZE_CODE
+    if (!parser.hadError) {
+#ifdef DEBUG_PRINT_CODE
+        printf("-- %s before optimizing --\n", name);
+        disassembleChunk(currentChunk(), name);
+#endif
+        optimizeChunk(currentChunk());
+    }
+#endif
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassembleChunk(currentChunk(), name);
     }
 #endif
 
+    // constants were added without barriers while it was compiled.
+    writeBarrier((Obj*)function);
     current = current->enclosing;
     return function;
 }
@@ -306,6 +588,83 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence( Precedence precedence);
 
+// fold a binary operator whose operands are both literals into the literal
+// result. Anything that would be a runtime error is left for the VM to report.
+// Arguments:
+//  operatorType - the operator.
+//  left - offset of the left operand's literal, or -1 if it isn't one.
+// Returns: true if folded, false if the operator still needs emitting.
+static bool foldBinary(TokenType operatorType, int left) {
+    int right = tailLiteral();
+    if (left == -1 || right != left + literalLength(currentChunk()->code[left])) return false;
+
+    Value a = literalValue(left);
+    Value b = literalValue(right);
+    Value result;
+
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        bool equal = valuesEqual(a, b);
+        result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+    } else if (IS_STRING(a) && IS_STRING(b)) {
+        if (operatorType != TOKEN_PLUS) return false;
+
+        ObjString* first = AS_STRING(a);
+        ObjString* second = AS_STRING(b);
+        int length = first->length + second->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, first->chars, first->length);
+        memcpy(chars + first->length, second->chars, second->length);
+        chars[length] = '\0';
+        result = OBJ_VAL(takeString(chars, length));
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        // >= and <= are computed the way the VM does, as the negation of < and >.
+        switch (operatorType) {
+            case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+            case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+            case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+            case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+            case TOKEN_PLUS:          result = NUMBER_VAL(x + y); break;
+            case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+            case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+            case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+            default:
+                return false;
+        }
+    } else {
+        return false;
+    }
+
+    // the right operand's constant was added last, so it goes first.
+    removeLiteral(right);
+    removeLiteral(left);
+    emitLiteral(result);
+    return true;
+}
+
+// fold a unary operator whose operand is a literal.
+// Arguments: operatorType - the operator.
+// Returns: true if folded, false if the operator still needs emitting.
+static bool foldUnary(TokenType operatorType) {
+    int operand = tailLiteral();
+    if (operand == -1) return false;
+
+    Value value = literalValue(operand);
+    Value result;
+    if (operatorType == TOKEN_BANG) {
+        result = BOOL_VAL(literalFalsey(value));
+    } else if (IS_NUMBER(value)) {
+        result = NUMBER_VAL(-AS_NUMBER(value));
+    } else {
+        return false;
+    }
+
+    removeLiteral(operand);
+    emitLiteral(result);
+    return true;
+}
+
 // handle binary operators.
 // Arguments: canAssign - whether we can assign at this point.
 // For this function it's a dummy since we have to have the same number of 
@@ -313,8 +672,35 @@ static void parsePrecedence( Precedence precedence);
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int left = tailLiteral();
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    if (foldBinary(operatorType, left)) return;
+
+    // remember numeric comparisons so a following condition jump can fuse
+    // with them. <= and >= compile to a comparison plus OP_NOT, so they
+    // fuse into "jump if greater" / "jump if less".
+    switch (operatorType) {
+        case TOKEN_GREATER:
+            current->comparisonJump = OP_JUMP_IF_NOT_GREATER;
+            current->lastComparison = currentChunk()->count;
+            break;
+        case TOKEN_GREATER_EQUAL:
+            current->comparisonJump = OP_JUMP_IF_NOT_GREATER_EQUAL;
+            current->lastComparison = currentChunk()->count;
+            break;
+        case TOKEN_LESS:
+            current->comparisonJump = OP_JUMP_IF_NOT_LESS;
+            current->lastComparison = currentChunk()->count;
+            break;
+        case TOKEN_LESS_EQUAL:
+            current->comparisonJump = OP_JUMP_IF_NOT_LESS_EQUAL;
+            current->lastComparison = currentChunk()->count;
+            break;
+        default:
+            break;
+    }
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
             emitBytes(OP_EQUAL, OP_NOT);
@@ -335,15 +721,23 @@ static void binary(bool canAssign) {
             emitBytes(OP_GREATER, OP_NOT);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            if (fuseAddLocals()) {
+                current->lastArithmetic = currentChunk()->count - 3;
+            } else {
+                current->lastArithmetic = currentChunk()->count;
+                emitByte(OP_ADD);
+            }
             break;
         case TOKEN_MINUS:
+            current->lastArithmetic = currentChunk()->count;
             emitByte(OP_SUBTRACT);
             break;
         case TOKEN_STAR:
+            current->lastArithmetic = currentChunk()->count;
             emitByte(OP_MULTIPLY);
             break;
         case TOKEN_SLASH:
+            current->lastArithmetic = currentChunk()->count;
             emitByte(OP_DIVIDE);
             break;
         default:
@@ -375,6 +769,7 @@ static uint8_t argumentList() {
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
     
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -384,6 +779,19 @@ static uint8_t identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// resolve a global variable name to its slot in the VM's globals array.
+// Returns: the slot index.
+static int globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 // handle a dot operator (for operating with fields and methods)
 // Arguments: canAssign - whether we can assign at this point.
 static void dot(bool canAssign) {
@@ -393,12 +801,16 @@ static void dot(bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         emitBytes(OP_SET_PROPERTY, name);
+        emitCache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitBytes(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        if (!fuseGetLocalProperty()) emitByte(OP_GET_PROPERTY);
+        emitByte(name);
+        emitCache();
     }
 }
 
@@ -409,13 +821,13 @@ static void dot(bool canAssign) {
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitLiteral(BOOL_VAL(false));
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitLiteral(NIL_VAL);
             break;
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitLiteral(BOOL_VAL(true));
             break;
         default: 
             return; // Unreachable.
@@ -581,13 +993,14 @@ static void declareVariable() {
 }
 
 // parse the variable name.
-static uint8_t parseVariable(const char* errorMessage) {
+// Returns: the global slot for a global variable, 0 for a local.
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void namedVariable(Token name, bool canAssign) {
@@ -600,15 +1013,25 @@ static void namedVariable(Token name, bool canAssign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        int slot = globalVariable(&name);
+        if (canAssign && match(TOKEN_EQUAL)) {
+            expression();
+            emitGlobal(OP_SET_GLOBAL, slot);
+        } else {
+            emitGlobal(OP_GET_GLOBAL, slot);
+        }
+        return;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
+        if (setOp == OP_SET_LOCAL) current->lastLocalSet = currentChunk()->count;
         emitBytes(setOp, (uint8_t)arg);
     } else {
+        if (getOp == OP_GET_LOCAL) {
+            current->prevLocalGet = current->lastLocalGet;
+            current->lastLocalGet = currentChunk()->count;
+        }
         emitBytes(getOp, (uint8_t)arg);
     }
 }
@@ -659,6 +1082,7 @@ static void unary(bool canAssign) {
 
     // Compile the operand.
     parsePrecedence(PREC_UNARY);
+    if (foldUnary(operatorType)) return;
 
     // Emit the operator instruction.
     switch (operatorType) {
@@ -747,13 +1171,13 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 // get the rule for the given token.
@@ -788,8 +1212,8 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
+            int local = parseVariable("Expect parameter name.");
+            defineVariable(local);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -822,9 +1246,10 @@ static void classDeclaration() {
     Token className = parser.previous;
     uint8_t nameConstant = identifierConstant(&parser.previous);
     declareVariable();
+    int global = current->scopeDepth > 0 ? 0 : globalVariable(&className);
 
     emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -862,14 +1287,14 @@ static void classDeclaration() {
 
 // declare a function.
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -886,7 +1311,60 @@ static void varDeclaration() {
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    emitExpressionPop();
+}
+
+// emit the jump out of an if, while or for when the condition is false.
+// A numeric comparison is fused with the jump (and the pop that follows it)
+// into one compare-and-branch instruction that consumes the operands itself.
+// "value < constant" gets its own OP_JUMP_IF_NOT_LESS_CONSTANT.
+// Arguments: popCondition - set to whether the exit path must still pop the condition.
+// Returns: the jump operand to patch.
+static int emitConditionJump(bool* popCondition) {
+    Chunk* chunk = currentChunk();
+    int comparison = current->lastComparison;
+    int length = current->comparisonJump == OP_JUMP_IF_NOT_LESS ||
+        current->comparisonJump == OP_JUMP_IF_NOT_GREATER ? 1 : 2;
+    if (comparison != -1 && comparison + length == chunk->count && current->jumpTarget <= comparison) {
+        uint8_t jump = current->comparisonJump;
+        current->lastComparison = -1;
+        *popCondition = false;
+
+        int start = comparison - 2;
+        if (jump == OP_JUMP_IF_NOT_LESS && current->lastConstant == start && current->jumpTarget <= start) {
+            uint8_t constant = chunk->code[start + 1];
+            chunk->count = start;
+            current->lastConstant = -1;
+            emitBytes(OP_JUMP_IF_NOT_LESS_CONSTANT, constant);
+            emitByte(0xff);
+            emitByte(0xff);
+            return chunk->count - 2;
+        }
+
+        chunk->count = comparison;
+        return emitJump(jump);
+    }
+
+    int jump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP); // Condition.
+    *popCondition = true;
+    return jump;
+}
+
+// compile a statement that can never run and throw its code away. It still
+// has to be parsed, and checked for errors, to get past it.
+// Nothing else refers to the constants and caches it added, so they go too.
+static void deadStatement() {
+    Chunk* chunk = currentChunk();
+    int start = chunk->count;
+    int constants = chunk->constants.count;
+    int caches = chunk->cacheCount;
+    statement();
+    chunk->count = start;
+    chunk->constants.count = constants;
+    chunk->cacheCount = caches;
+    resetFusion();
+    markJumpTarget();
 }
 
 // handle a for statement.
@@ -904,14 +1382,14 @@ static void forStatement() {
     }
 
     // optional end condition.
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     int exitJump = -1;
+    bool popCondition = false;
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitConditionJump(&popCondition);
     }
 
     // optional increment clause.
@@ -919,9 +1397,9 @@ static void forStatement() {
     // jump back to increment and run it, then go to next iteration.
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
-        emitByte(OP_POP);
+        emitExpressionPop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
         emitLoop(loopStart);
         loopStart = incrementStart;
@@ -934,7 +1412,7 @@ static void forStatement() {
 
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
+        if (popCondition) emitByte(OP_POP); // Condition.
     }
 
     endScope();
@@ -945,14 +1423,24 @@ static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-    
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+
+    // "if (false)" and friends only compile the branch that is taken.
+    bool truthy;
+    if (constantCondition(&truthy)) {
+        if (truthy) statement(); else deadStatement();
+        if (match(TOKEN_ELSE)) {
+            if (truthy) deadStatement(); else statement();
+        }
+        return;
+    }
+
+    bool popCondition;
+    int thenJump = emitConditionJump(&popCondition);
     statement();
 
     int elseJump = emitJump(OP_JUMP);
     patchJump(thenJump);
-    emitByte(OP_POP);
+    if (popCondition) emitByte(OP_POP);
 
     if (match(TOKEN_ELSE)) {
         statement();
@@ -983,23 +1471,40 @@ static void returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // a call whose result is returned as it is can reuse this frame.
+        if (current->lastCall != -1 && current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
 
 static void whileStatement() {
-    int loopStart = currentChunk()-> count;
+    int loopStart = markJumpTarget();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    // "while (false)" never runs its body and "while (true)" never exits.
+    bool truthy;
+    if (constantCondition(&truthy)) {
+        if (truthy) {
+            statement();
+            emitLoop(loopStart);
+        } else {
+            deadStatement();
+        }
+        return;
+    }
+
+    bool popCondition;
+    int exitJump = emitConditionJump(&popCondition);
     statement();
     emitLoop(loopStart);
     patchJump(exitJump);
-    emitByte(OP_POP);
+    if (popCondition) emitByte(OP_POP);
 }
 
 // synchronize after panicking because of a compile error, i.e. skip forward to what looks like the next statement.
@@ -1092,6 +1597,9 @@ void markCompilerRoots() {
     Compiler* compiler = current;
     while (compiler != NULL) {
         markObject((Obj*)compiler->function);
+        // constants are added without write barriers, so the functions being
+        // compiled are remembered by every collection until they're finished.
+        if (compiler->function != NULL) writeBarrier((Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
 }
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 // show all the instructions in a chunk
 void disassembleChunk(Chunk* chunk, const char* name) {
@@ -45,6 +46,100 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+// instruction addresses a global variable slot.
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+
+    return offset + 3;
+}
+
+// instruction has two byte operands.
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+// instruction reads a property of a local.
+static int localPropertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+
+    return offset + 5;
+}
+
+// three-address instruction on local slots.
+static int registerInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t dst = chunk->code[offset + 1];
+    uint8_t a = chunk->code[offset + 2];
+    uint8_t b = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d\n", name, dst, a, b);
+    return offset + 4;
+}
+
+// three-address instruction on a local slot and a constant.
+static int registerConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t dst = chunk->code[offset + 1];
+    uint8_t a = chunk->code[offset + 2];
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d %4d %4d '", name, dst, a, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// instruction compares with a constant and jumps.
+static int constantJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' %4d -> %d\n", offset, offset + 4 + jump);
+
+    return offset + 4;
+}
+
+// instruction is a property access with an inline cache.
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+
+    return offset + 4;
+}
+
+// instruction is an invoke with an inline cache.
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+
+    return offset + 5;
+}
+
 // instruction is an invoke.
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -82,19 +177,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -105,6 +200,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_LESS", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_ADD_GENERIC:
+            return simpleInstruction("OP_ADD_GENERIC", offset);
         case OP_SUBTRACT:
             return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
@@ -121,12 +222,22 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -155,6 +266,28 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_ADD_LOCALS:
+            return twoByteInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_CONSTANT:
+            return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_CONSTANT", chunk, offset);
+        case OP_ADD_RR:
+            return registerInstruction("OP_ADD_RR", chunk, offset);
+        case OP_SUBTRACT_RR:
+            return registerInstruction("OP_SUBTRACT_RR", chunk, offset);
+        case OP_MULTIPLY_RR:
+            return registerInstruction("OP_MULTIPLY_RR", chunk, offset);
+        case OP_DIVIDE_RR:
+            return registerInstruction("OP_DIVIDE_RR", chunk, offset);
+        case OP_ADD_RK:
+            return registerConstantInstruction("OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return registerConstantInstruction("OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return registerConstantInstruction("OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return registerConstantInstruction("OP_DIVIDE_RK", chunk, offset);
         default: {
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
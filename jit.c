@@ -0,0 +1,1373 @@
+#include <stdarg.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "vm.h"
+
+// A baseline template JIT. Each instruction of a hot chunk becomes a fixed
+// sequence of x86-64 code that works on the VM's own value stack, so the GC
+// and runtime errors see exactly the state the interpreter would have left.
+// Instructions without a template (calls, properties, anything that can
+// allocate) and failed type guards leave the native code, which returns
+// the bytecode offset of the instruction for run() to carry on from.
+//
+// Registers while native code runs:
+//  rbx - the frame's slots.
+//  r12 - vm.stackTop.
+//  r14 - QNAN, for number checks.
+//  rax, rcx, rdx, r11, xmm0 and xmm1 are scratch.
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+
+// signature of the native code's entry point.
+typedef int (*JitFunction)(Value* slots, Value* stackTop, uint8_t* entry);
+
+// a rel32 operand to fill in once the code it jumps to has been placed.
+typedef struct {
+    int at;         // where the operand is in the code.
+    int offset;     // bytecode offset it jumps to (or, for bails, leaves at).
+} Fixup;
+
+// native code being assembled for one chunk.
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+    uint8_t* code;
+    int count;
+    int capacity;
+    Fixup* jumps;       // jumps to other instructions.
+    int jumpCount;
+    int jumpCapacity;
+    Fixup* bails;       // failed guards, to be pointed at exit stubs.
+    int bailCount;
+    int bailCapacity;
+    int* entries;       // bytecode offset -> code offset.
+    int exit;           // code offset of the shared exit.
+    int maxPush;
+} Assembler;
+
+static void emit(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+// emit a run of machine code bytes.
+// Arguments:
+//  count - how many bytes follow.
+static void emitCode(Assembler* as, int count, ...) {
+    va_list bytes;
+    va_start(bytes, count);
+    for (int i = 0; i < count; i++) emit(as, (uint8_t)va_arg(bytes, int));
+    va_end(bytes);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit(as, (value >> (i * 8)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit(as, (value >> (i * 8)) & 0xff);
+}
+
+static void patch32(Assembler* as, int at, int32_t value) {
+    for (int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t)value >> (i * 8)) & 0xff;
+}
+
+// record a fixup for the rel32 operand about to be emitted.
+static void addFixup(Fixup** fixups, int* count, int* capacity, int at, int offset) {
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *fixups = GROW_ARRAY(Fixup, *fixups, oldCapacity, *capacity);
+    }
+    (*fixups)[*count].at = at;
+    (*fixups)[*count].offset = offset;
+    (*count)++;
+}
+
+// jump to the code for a bytecode offset.
+// Arguments: condition - the jcc condition code, or -1 for an unconditional jmp.
+static void emitJumpTo(Assembler* as, int condition, int offset) {
+    if (condition == -1) {
+        emit(as, 0xe9);
+    } else {
+        emitCode(as, 2, 0x0f, 0x80 | condition);
+    }
+    addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, as->count, offset);
+    emit32(as, 0);
+}
+
+// leave the native code, to run the instruction at offset in the interpreter.
+// Arguments: condition - the jcc condition code, or -1 to always leave.
+static void emitBail(Assembler* as, int condition, int offset) {
+    if (condition == -1) {
+        emit(as, 0xe9);
+    } else {
+        emitCode(as, 2, 0x0f, 0x80 | condition);
+    }
+    addFixup(&as->bails, &as->bailCount, &as->bailCapacity, as->count, offset);
+    emit32(as, 0);
+}
+
+// jcc condition codes.
+#define CC_E  0x4
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_NP 0xb
+
+// short jump forward with a placeholder distance.
+// Returns: where the distance goes.
+static int emitShortJump(Assembler* as, uint8_t opcode) {
+    emitCode(as, 2, opcode, 0);
+    return as->count - 1;
+}
+
+static void patchShortJump(Assembler* as, int at) {
+    as->code[at] = (uint8_t)(as->count - at - 1);
+}
+
+// mov reg, [r12 - 8 * depth]: read a value from the top of the stack.
+static void loadStack(Assembler* as, int reg, int depth) {
+    emitCode(as, 5, 0x49, 0x8b, 0x44 | (reg << 3), 0x24, (uint8_t)(-8 * depth));
+}
+
+// mov [r12 - 8 * depth], reg
+static void storeStack(Assembler* as, int reg, int depth) {
+    emitCode(as, 5, 0x49, 0x89, 0x44 | (reg << 3), 0x24, (uint8_t)(-8 * depth));
+}
+
+// move vm.stackTop by a number of values.
+static void adjustStack(Assembler* as, int values) {
+    if (values > 0) {
+        emitCode(as, 4, 0x49, 0x83, 0xc4, 8 * values);    // add r12, imm8
+    } else {
+        emitCode(as, 4, 0x49, 0x83, 0xec, -8 * values);   // sub r12, imm8
+    }
+}
+
+static void pushRegister(Assembler* as, int reg) {
+    storeStack(as, reg, 0);
+    adjustStack(as, 1);
+}
+
+// mov reg, [rbx + 8 * slot]
+static void loadLocal(Assembler* as, int reg, int slot) {
+    emitCode(as, 3, 0x48, 0x8b, 0x83 | (reg << 3));
+    emit32(as, 8 * slot);
+}
+
+// mov [rbx + 8 * slot], reg
+static void storeLocal(Assembler* as, int reg, int slot) {
+    emitCode(as, 3, 0x48, 0x89, 0x83 | (reg << 3));
+    emit32(as, 8 * slot);
+}
+
+// mov reg, imm64
+static void loadImmediate(Assembler* as, int reg, uint64_t value) {
+    emitCode(as, 2, 0x48, 0xb8 + reg);
+    emit64(as, value);
+}
+
+// leave unless reg holds a number.
+static void guardNumber(Assembler* as, int reg, int offset) {
+    emitCode(as, 3, 0x49, 0x89, 0xc3 | (reg << 3));    // mov r11, reg
+    emitCode(as, 3, 0x4d, 0x21, 0xf3);                  // and r11, r14
+    emitCode(as, 3, 0x4d, 0x39, 0xf3);                  // cmp r11, r14
+    emitBail(as, CC_E, offset);
+}
+
+// movq xmm, reg
+static void moveToDouble(Assembler* as, int xmm, int reg) {
+    emitCode(as, 5, 0x66, 0x48, 0x0f, 0x6e, 0xc0 | (xmm << 3) | reg);
+}
+
+// movq reg, xmm
+static void moveFromDouble(Assembler* as, int reg, int xmm) {
+    emitCode(as, 5, 0x66, 0x48, 0x0f, 0x7e, 0xc0 | (xmm << 3) | reg);
+}
+
+// ucomisd xmm_a, xmm_b
+static void compareDoubles(Assembler* as, int a, int b) {
+    emitCode(as, 4, 0x66, 0x0f, 0x2e, 0xc0 | (a << 3) | b);
+}
+
+// rax = a op b for the numbers in rax and rcx.
+// Arguments: op - the SSE2 opcode (addsd, subsd, mulsd or divsd).
+static void emitDoubleOp(Assembler* as, uint8_t op) {
+    moveToDouble(as, 0, RAX);
+    moveToDouble(as, 1, RCX);
+    emitCode(as, 4, 0xf2, 0x0f, op, 0xc1);             // op xmm0, xmm1
+    moveFromDouble(as, RAX, 0);
+}
+
+// rax = a op b for the numbers in rax and rcx, leaving if either isn't one.
+static void emitArithmetic(Assembler* as, uint8_t op, int offset) {
+    guardNumber(as, RAX, offset);
+    guardNumber(as, RCX, offset);
+    emitDoubleOp(as, op);
+}
+
+// rax = true if the flags say condition, else false.
+static void emitBoolFromFlags(Assembler* as, int condition) {
+    emitCode(as, 3, 0x0f, 0x90 | condition, 0xc0);      // setcc al
+    emitCode(as, 3, 0x0f, 0xb6, 0xc0);                  // movzx eax, al
+    loadImmediate(as, RCX, FALSE_VAL);
+    emitCode(as, 3, 0x48, 0x01, 0xc8);                  // add rax, rcx
+}
+
+// load the top two values into xmm0 (a) and xmm1 (b), leaving to the
+// interpreter at offset if a guarded one isn't a number.
+static void loadStackNumbers(Assembler* as, bool guardA, bool guardB, int offset) {
+    loadStack(as, RAX, 2);
+    loadStack(as, RCX, 1);
+    if (guardA) guardNumber(as, RAX, offset);
+    if (guardB) guardNumber(as, RCX, offset);
+    moveToDouble(as, 0, RAX);
+    moveToDouble(as, 1, RCX);
+}
+
+static void loadNumberOperands(Assembler* as, int offset) {
+    loadStackNumbers(as, true, true, offset);
+}
+
+// compare xmm0 (a) and xmm1 (b) for a fused compare-and-branch.
+// Returns: the condition code under which the instruction jumps.
+static int emitBranchCompare(Assembler* as, uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP_IF_NOT_LESS:           // !(a < b)
+            compareDoubles(as, 1, 0);
+            return CC_BE;
+        case OP_JUMP_IF_NOT_LESS_EQUAL:     // a > b
+            compareDoubles(as, 0, 1);
+            return CC_A;
+        case OP_JUMP_IF_NOT_GREATER:        // !(a > b)
+            compareDoubles(as, 0, 1);
+            return CC_BE;
+        default:                            // a < b
+            compareDoubles(as, 1, 0);
+            return CC_A;
+    }
+}
+
+// jump to target if rax is nil or false.
+static void emitJumpIfFalsey(Assembler* as, int target) {
+    loadImmediate(as, RCX, NIL_VAL);
+    emitCode(as, 3, 0x48, 0x39, 0xc8);                  // cmp rax, rcx
+    emitJumpTo(as, CC_E, target);
+    loadImmediate(as, RCX, FALSE_VAL);
+    emitCode(as, 3, 0x48, 0x39, 0xc8);
+    emitJumpTo(as, CC_E, target);
+}
+
+// replace the top two values with whether they're equal. Numbers compare
+// as doubles, everything else by its bits.
+static void emitEqual(Assembler* as) {
+    loadStack(as, RAX, 2);
+    loadStack(as, RCX, 1);
+    emitCode(as, 3, 0x49, 0x89, 0xc3);                  // mov r11, rax
+    emitCode(as, 6, 0x4d, 0x21, 0xf3, 0x4d, 0x39, 0xf3);
+    int aBits = emitShortJump(as, 0x74);                // je bits
+    emitCode(as, 3, 0x49, 0x89, 0xcb);                  // mov r11, rcx
+    emitCode(as, 6, 0x4d, 0x21, 0xf3, 0x4d, 0x39, 0xf3);
+    int bBits = emitShortJump(as, 0x74);
+    moveToDouble(as, 0, RAX);
+    moveToDouble(as, 1, RCX);
+    compareDoubles(as, 0, 1);
+    emitCode(as, 3, 0x0f, 0x94, 0xc0);                  // sete al
+    emitCode(as, 3, 0x0f, 0x9b, 0xc1);                  // setnp cl
+    emitCode(as, 2, 0x20, 0xc8);                        // and al, cl
+    int done = emitShortJump(as, 0xeb);
+    patchShortJump(as, aBits);
+    patchShortJump(as, bBits);
+    emitCode(as, 3, 0x48, 0x39, 0xc8);                  // cmp rax, rcx
+    emitCode(as, 3, 0x0f, 0x94, 0xc0);                  // sete al
+    patchShortJump(as, done);
+    emitCode(as, 3, 0x0f, 0xb6, 0xc0);                  // movzx eax, al
+    loadImmediate(as, RCX, FALSE_VAL);
+    emitCode(as, 3, 0x48, 0x01, 0xc8);                  // add rax, rcx
+    storeStack(as, RAX, 2);
+    adjustStack(as, -1);
+}
+
+// replace the top value with whether it's falsey.
+static void emitNot(Assembler* as) {
+    loadStack(as, RAX, 1);
+    loadImmediate(as, RCX, NIL_VAL);
+    emitCode(as, 3, 0x48, 0x39, 0xc8);                  // cmp rax, rcx
+    int isNil = emitShortJump(as, 0x74);
+    loadImmediate(as, RCX, FALSE_VAL);
+    emitCode(as, 3, 0x48, 0x39, 0xc8);
+    int isFalse = emitShortJump(as, 0x74);
+    loadImmediate(as, RAX, FALSE_VAL);
+    int done = emitShortJump(as, 0xeb);
+    patchShortJump(as, isNil);
+    patchShortJump(as, isFalse);
+    loadImmediate(as, RAX, TRUE_VAL);
+    patchShortJump(as, done);
+    storeStack(as, RAX, 1);
+}
+
+// rax = vm.globalValues.values
+static void loadGlobals(Assembler* as) {
+    loadImmediate(as, RAX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitCode(as, 3, 0x48, 0x8b, 0x00);                  // mov rax, [rax]
+}
+
+// the SSE2 opcode for an arithmetic instruction.
+static uint8_t arithmeticOp(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_ADD_GENERIC:
+        case OP_ADD_LOCALS:
+        case OP_ADD_RR:
+        case OP_ADD_RK:
+            return 0x58;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_RR:
+        case OP_SUBTRACT_RK:
+            return 0x5c;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_RR:
+        case OP_MULTIPLY_RK:
+            return 0x59;
+        default:
+            return 0x5e;
+    }
+}
+
+// find the trace for a loop header.
+// Returns: the trace, or NULL if the loop hasn't been seen.
+static LoopTrace* findTrace(ObjFunction* function, int header) {
+    for (int i = 0; i < function->traceCount; i++) {
+        if (function->traces[i].header == header) return &function->traces[i];
+    }
+    return NULL;
+}
+
+// emit the template for one instruction.
+// Returns: false if the instruction has no template, so its code only leaves.
+static bool emitInstruction(Assembler* as, int offset) {
+    Chunk* chunk = as->chunk;
+    uint8_t* code = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            loadImmediate(as, RAX, chunk->constants.values[code[1]]);
+            pushRegister(as, RAX);
+            return true;
+        case OP_NIL:
+            loadImmediate(as, RAX, NIL_VAL);
+            pushRegister(as, RAX);
+            return true;
+        case OP_TRUE:
+            loadImmediate(as, RAX, TRUE_VAL);
+            pushRegister(as, RAX);
+            return true;
+        case OP_FALSE:
+            loadImmediate(as, RAX, FALSE_VAL);
+            pushRegister(as, RAX);
+            return true;
+        case OP_POP:
+            adjustStack(as, -1);
+            return true;
+        case OP_GET_LOCAL:
+            loadLocal(as, RAX, code[1]);
+            pushRegister(as, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            loadStack(as, RCX, 1);
+            storeLocal(as, RCX, code[1]);
+            return true;
+        case OP_GET_GLOBAL: {
+            int slot = (code[1] << 8) | code[2];
+            loadGlobals(as);
+            emitCode(as, 3, 0x48, 0x8b, 0x80);          // mov rax, [rax + disp32]
+            emit32(as, 8 * slot);
+            loadImmediate(as, RCX, UNDEFINED_VAL);
+            emitCode(as, 3, 0x48, 0x39, 0xc8);          // cmp rax, rcx
+            emitBail(as, CC_E, offset);
+            pushRegister(as, RAX);
+            return true;
+        }
+        case OP_SET_GLOBAL: {
+            int slot = (code[1] << 8) | code[2];
+            loadGlobals(as);
+            emitCode(as, 3, 0x48, 0x8b, 0x88);          // mov rcx, [rax + disp32]
+            emit32(as, 8 * slot);
+            loadImmediate(as, RDX, UNDEFINED_VAL);
+            emitCode(as, 3, 0x48, 0x39, 0xd1);          // cmp rcx, rdx
+            emitBail(as, CC_E, offset);
+            loadStack(as, RCX, 1);
+            emitCode(as, 3, 0x48, 0x89, 0x88);          // mov [rax + disp32], rcx
+            emit32(as, 8 * slot);
+            return true;
+        }
+        case OP_EQUAL:
+            emitEqual(as);
+            return true;
+        case OP_GREATER:
+            loadNumberOperands(as, offset);
+            compareDoubles(as, 0, 1);
+            emitBoolFromFlags(as, CC_A);
+            storeStack(as, RAX, 2);
+            adjustStack(as, -1);
+            return true;
+        case OP_LESS:
+            loadNumberOperands(as, offset);
+            compareDoubles(as, 1, 0);
+            emitBoolFromFlags(as, CC_A);
+            storeStack(as, RAX, 2);
+            adjustStack(as, -1);
+            return true;
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_ADD_GENERIC:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            // strings are concatenated by the interpreter.
+            loadStack(as, RAX, 2);
+            loadStack(as, RCX, 1);
+            emitArithmetic(as, arithmeticOp(code[0]), offset);
+            storeStack(as, RAX, 2);
+            adjustStack(as, -1);
+            return true;
+        case OP_NOT:
+            emitNot(as);
+            return true;
+        case OP_NEGATE:
+            loadStack(as, RAX, 1);
+            guardNumber(as, RAX, offset);
+            emitCode(as, 5, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+            storeStack(as, RAX, 1);
+            return true;
+        case OP_JUMP:
+            emitJumpTo(as, -1, next + ((code[1] << 8) | code[2]));
+            return true;
+        case OP_LOOP: {
+            // a loop that has been traced carries on in its trace, which
+            // expects the same registers and leaves through the same exit.
+            int header = next - ((code[1] << 8) | code[2]);
+            LoopTrace* trace = findTrace(as->function, header);
+            if (trace != NULL && trace->code != NULL) {
+                loadImmediate(as, RAX, (uint64_t)(uintptr_t)(trace->code + trace->entry));
+                emitCode(as, 2, 0xff, 0xe0);            // jmp rax
+            } else {
+                emitJumpTo(as, -1, header);
+            }
+            return true;
+        }
+        case OP_JUMP_IF_FALSE:
+            loadStack(as, RAX, 1);
+            emitJumpIfFalsey(as, next + ((code[1] << 8) | code[2]));
+            return true;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+            int target = next + ((code[1] << 8) | code[2]);
+            loadNumberOperands(as, offset);
+            adjustStack(as, -2);
+            emitJumpTo(as, emitBranchCompare(as, code[0]), target);
+            return true;
+        }
+        case OP_JUMP_IF_NOT_LESS_CONSTANT: {
+            Value constant = chunk->constants.values[code[1]];
+            if (!IS_NUMBER(constant)) return false;
+
+            loadStack(as, RAX, 1);
+            guardNumber(as, RAX, offset);
+            moveToDouble(as, 0, RAX);
+            loadImmediate(as, RCX, constant);
+            moveToDouble(as, 1, RCX);
+            adjustStack(as, -1);
+            compareDoubles(as, 1, 0);
+            emitJumpTo(as, CC_BE, next + ((code[2] << 8) | code[3]));
+            return true;
+        }
+        case OP_ADD_LOCALS:
+            loadLocal(as, RAX, code[1]);
+            loadLocal(as, RCX, code[2]);
+            emitArithmetic(as, arithmeticOp(code[0]), offset);
+            pushRegister(as, RAX);
+            return true;
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+            loadLocal(as, RAX, code[2]);
+            loadLocal(as, RCX, code[3]);
+            emitArithmetic(as, arithmeticOp(code[0]), offset);
+            storeLocal(as, RAX, code[1]);
+            return true;
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK: {
+            Value constant = chunk->constants.values[code[3]];
+            if (!IS_NUMBER(constant)) return false;
+
+            loadLocal(as, RAX, code[2]);
+            loadImmediate(as, RCX, constant);
+            emitArithmetic(as, arithmeticOp(code[0]), offset);
+            storeLocal(as, RAX, code[1]);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// does an instruction with a template leave one more value on the stack?
+static bool pushesValue(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_ADD_LOCALS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the entry point and the shared exit, which writes vm.stackTop back and
+// returns the offset the caller loaded into eax.
+static void emitPrologue(Assembler* as) {
+    emitCode(as, 1, 0x53);                              // push rbx
+    emitCode(as, 1, 0x55);                              // push rbp
+    emitCode(as, 8, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push r12-r15
+    emitCode(as, 3, 0x48, 0x89, 0xfb);                  // mov rbx, rdi
+    emitCode(as, 3, 0x49, 0x89, 0xf4);                  // mov r12, rsi
+    emitCode(as, 2, 0x49, 0xbe);                        // mov r14, QNAN
+    emit64(as, QNAN);
+    emitCode(as, 2, 0xff, 0xe2);                        // jmp rdx
+
+    as->exit = as->count;
+    loadImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitCode(as, 3, 0x4c, 0x89, 0x21);                  // mov [rcx], r12
+    emitCode(as, 8, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c); // pop r15-r12
+    emitCode(as, 1, 0x5d);                              // pop rbp
+    emitCode(as, 1, 0x5b);                              // pop rbx
+    emitCode(as, 1, 0xc3);                              // ret
+}
+
+// leave the native code to interpret the instruction at offset.
+static void emitExit(Assembler* as, int offset) {
+    emit(as, 0xb8);                                     // mov eax, offset
+    emit32(as, offset);
+    emit(as, 0xe9);                                     // jmp exit
+    emit32(as, as->exit - (as->count + 4));
+}
+
+// point every failed guard at its own exit stub.
+static void emitBailExits(Assembler* as) {
+    for (int i = 0; i < as->bailCount; i++) {
+        int at = as->bails[i].at;
+        patch32(as, at, as->count - (at + 4));
+        emitExit(as, as->bails[i].offset);
+    }
+}
+
+// copy assembled code into executable memory. The memory is written while
+// it's writable and only then made executable.
+// Returns: the code, or NULL if it couldn't be mapped.
+static uint8_t* mapCode(Assembler* as) {
+    size_t size = (size_t)as->count;
+    uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+
+    memcpy(code, as->code, size);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        return NULL;
+    }
+    return code;
+}
+
+static void freeAssembler(Assembler* as) {
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(Fixup, as->jumps, as->jumpCapacity);
+    FREE_ARRAY(Fixup, as->bails, as->bailCapacity);
+}
+
+void compileJit(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+    as.function = function;
+    as.chunk = chunk;
+    as.entries = ALLOCATE(int, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++) as.entries[offset] = -1;
+
+    emitPrologue(&as);
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        as.entries[offset] = as.count;
+        if (emitInstruction(&as, offset)) {
+            if (pushesValue(chunk->code[offset])) as.maxPush++;
+        } else {
+            emitExit(&as, offset);
+        }
+    }
+
+    for (int i = 0; i < as.jumpCount; i++) {
+        int at = as.jumps[i].at;
+        patch32(&as, at, as.entries[as.jumps[i].offset] - (at + 4));
+    }
+    emitBailExits(&as);
+
+    uint8_t* code = mapCode(&as);
+    if (code != NULL) {
+        JitCode* jit = ALLOCATE(JitCode, 1);
+        jit->code = code;
+        jit->size = (size_t)as.count;
+        jit->entries = as.entries;
+        jit->entryCount = chunk->count;
+        jit->maxPush = as.maxPush;
+        function->jit = jit;
+    } else {
+        // the code couldn't be mapped, the function just stays interpreted.
+        FREE_ARRAY(int, as.entries, chunk->count);
+    }
+    freeAssembler(&as);
+}
+
+int enterJit(ObjFunction* function, int offset, Value* slots) {
+    JitCode* jit = function->jit;
+    int entry = jit->entries[offset];
+    if (entry == -1 || vm.stackTop + jit->maxPush > vm.stack + vm.frameCapacity * FRAME_SLOTS) return offset;
+
+    JitFunction native = (JitFunction)(void*)jit->code;
+    return native(slots, vm.stackTop, jit->code + entry);
+}
+
+// Tracing. Once a loop's backedge is hot, the next iteration is recorded:
+// the recorder steps through it on copies of the frame and the globals,
+// noting each instruction and which way each branch went. The recording is
+// compiled to one straight run of code that loops back to its own start.
+// The path not recorded leaves the trace, so the trace only has to handle
+// the types and branch directions it saw, and the compiler tracks what is
+// known about each value to drop the guards and arithmetic it can prove.
+// Locals and globals that enter the loop as numbers and stay numbers are
+// guarded once on entry instead of on every use.
+
+// most globals one trace can touch.
+#define TRACE_MAX_GLOBALS 16
+
+// what the trace compiler knows about a value.
+typedef struct {
+    bool number;        // certainly a number.
+    bool constant;      // certainly value.
+    Value value;
+} Known;
+
+// a global the trace touches.
+typedef struct {
+    int slot;
+    Value value;        // the simulated value while recording.
+    bool invariant;     // entered the loop as a number and was read.
+    Known known;
+} TraceGlobal;
+
+// one recorded instruction.
+typedef struct {
+    int offset;
+    bool taken;         // for branches, whether the recorded iteration jumped.
+} TraceOp;
+
+typedef struct {
+    ObjFunction* function;
+    int header;
+    int base;                           // slots in use at the loop header.
+    TraceOp ops[TRACE_MAX_OPS];
+    int opCount;
+    bool invariant[UINT8_COUNT];        // locals below base guarded once on entry.
+    TraceGlobal globals[TRACE_MAX_GLOBALS];
+    int globalCount;
+} Recorder;
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// a op b for an arithmetic instruction's SSE2 opcode.
+static double foldArithmetic(uint8_t op, double a, double b) {
+    switch (op) {
+        case 0x58: return a + b;
+        case 0x5c: return a - b;
+        case 0x59: return a * b;
+        default:   return a / b;
+    }
+}
+
+// does a fused compare-and-branch jump?
+static bool branchTaken(uint8_t instruction, double a, double b) {
+    switch (instruction) {
+        case OP_JUMP_IF_NOT_LESS:           return !(a < b);
+        case OP_JUMP_IF_NOT_LESS_EQUAL:     return a > b;
+        case OP_JUMP_IF_NOT_GREATER:        return !(a > b);
+        default:                            return a < b;
+    }
+}
+
+// find the recorder's entry for a global, adding it on first touch.
+// Returns: the entry, or NULL if the trace touches too many globals.
+static TraceGlobal* traceGlobal(Recorder* rec, int slot) {
+    for (int i = 0; i < rec->globalCount; i++) {
+        if (rec->globals[i].slot == slot) return &rec->globals[i];
+    }
+    if (rec->globalCount == TRACE_MAX_GLOBALS) return NULL;
+
+    TraceGlobal* global = &rec->globals[rec->globalCount++];
+    global->slot = slot;
+    global->value = vm.globalValues.values[slot];
+    global->invariant = false;
+    return global;
+}
+
+// step through one iteration of the loop from its header, without changing
+// any VM state, until it jumps back to the header.
+// Returns: false if the iteration can't be traced - it leaves the loop, runs
+// an inner loop or an instruction without a template, or fails a type check.
+static bool recordTrace(Recorder* rec, Value* slots) {
+    Chunk* chunk = &rec->function->chunk;
+    Value frame[UINT8_COUNT + TRACE_MAX_OPS];
+    int base = rec->base;
+    int top = base;
+    memcpy(frame, slots, sizeof(Value) * base);
+
+#define POP() frame[--top]
+#define PUSH(value) (frame[top++] = (value))
+
+    int offset = rec->header;
+    for (;;) {
+        if (rec->opCount == TRACE_MAX_OPS) return false;
+
+        uint8_t* code = &chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        TraceOp* op = &rec->ops[rec->opCount++];
+        op->offset = offset;
+        op->taken = false;
+
+        // the values an instruction pops must have been pushed in the loop.
+        int pops = 0;
+        switch (code[0]) {
+            case OP_POP: case OP_SET_LOCAL: case OP_SET_GLOBAL: case OP_NOT:
+            case OP_NEGATE: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_NOT_LESS_CONSTANT:
+                pops = 1;
+                break;
+            case OP_EQUAL: case OP_GREATER: case OP_LESS: case OP_ADD:
+            case OP_ADD_NUMBER: case OP_ADD_STRING: case OP_ADD_GENERIC: case OP_SUBTRACT:
+            case OP_MULTIPLY: case OP_DIVIDE: case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_EQUAL:
+            case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_EQUAL:
+                pops = 2;
+                break;
+        }
+        if (top - base < pops) return false;
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+                PUSH(chunk->constants.values[code[1]]);
+                break;
+            case OP_NIL: PUSH(NIL_VAL); break;
+            case OP_TRUE: PUSH(BOOL_VAL(true)); break;
+            case OP_FALSE: PUSH(BOOL_VAL(false)); break;
+            case OP_POP:
+                top--;
+                break;
+            case OP_GET_LOCAL:
+                if (code[1] >= top) return false;
+                if (code[1] < base && IS_NUMBER(slots[code[1]])) rec->invariant[code[1]] = true;
+                PUSH(frame[code[1]]);
+                break;
+            case OP_SET_LOCAL:
+                if (code[1] >= top) return false;
+                frame[code[1]] = frame[top - 1];
+                break;
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                TraceGlobal* global = traceGlobal(rec, (code[1] << 8) | code[2]);
+                if (global == NULL || IS_UNDEFINED(global->value)) return false;
+                if (code[0] == OP_GET_GLOBAL) {
+                    if (IS_NUMBER(vm.globalValues.values[global->slot])) global->invariant = true;
+                    PUSH(global->value);
+                } else {
+                    global->value = frame[top - 1];
+                }
+                break;
+            }
+            case OP_EQUAL: {
+                Value b = POP();
+                Value a = POP();
+                PUSH(BOOL_VAL(valuesEqual(a, b)));
+                break;
+            }
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_ADD_NUMBER:
+            case OP_ADD_STRING:
+            case OP_ADD_GENERIC:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE: {
+                Value b = POP();
+                Value a = POP();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+                if (code[0] == OP_GREATER) {
+                    PUSH(BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b)));
+                } else if (code[0] == OP_LESS) {
+                    PUSH(BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)));
+                } else {
+                    PUSH(NUMBER_VAL(foldArithmetic(arithmeticOp(code[0]), AS_NUMBER(a), AS_NUMBER(b))));
+                }
+                break;
+            }
+            case OP_NOT:
+                frame[top - 1] = BOOL_VAL(isFalsey(frame[top - 1]));
+                break;
+            case OP_NEGATE: {
+                Value a = POP();
+                if (!IS_NUMBER(a)) return false;
+                PUSH(NUMBER_VAL(-AS_NUMBER(a)));
+                break;
+            }
+            case OP_JUMP:
+                next += (code[1] << 8) | code[2];
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (isFalsey(frame[top - 1])) {
+                    op->taken = true;
+                    next += (code[1] << 8) | code[2];
+                }
+                break;
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_NOT_LESS_EQUAL:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+                Value b = POP();
+                Value a = POP();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+                if (branchTaken(code[0], AS_NUMBER(a), AS_NUMBER(b))) {
+                    op->taken = true;
+                    next += (code[1] << 8) | code[2];
+                }
+                break;
+            }
+            case OP_JUMP_IF_NOT_LESS_CONSTANT: {
+                Value b = chunk->constants.values[code[1]];
+                Value a = POP();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+                    op->taken = true;
+                    next += (code[2] << 8) | code[3];
+                }
+                break;
+            }
+            case OP_ADD_LOCALS: {
+                if (code[1] >= top || code[2] >= top) return false;
+                Value a = frame[code[1]];
+                Value b = frame[code[2]];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+                if (code[1] < base) rec->invariant[code[1]] = true;
+                if (code[2] < base) rec->invariant[code[2]] = true;
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                break;
+            }
+            case OP_ADD_RR:
+            case OP_SUBTRACT_RR:
+            case OP_MULTIPLY_RR:
+            case OP_DIVIDE_RR:
+            case OP_ADD_RK:
+            case OP_SUBTRACT_RK:
+            case OP_MULTIPLY_RK:
+            case OP_DIVIDE_RK: {
+                bool constant = code[0] >= OP_ADD_RK;
+                if (code[1] >= top || code[2] >= top || (!constant && code[3] >= top)) return false;
+                Value a = frame[code[2]];
+                Value b = constant ? chunk->constants.values[code[3]] : frame[code[3]];
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+                if (code[2] < base) rec->invariant[code[2]] = true;
+                if (!constant && code[3] < base) rec->invariant[code[3]] = true;
+                frame[code[1]] = NUMBER_VAL(foldArithmetic(arithmeticOp(code[0]), AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case OP_LOOP:
+                next -= (code[1] << 8) | code[2];
+                if (next == rec->header) return top == base;
+                break;
+            default:
+                return false;
+        }
+
+        // coming back round to an instruction that isn't the header means an
+        // inner loop, which has its own trace.
+        for (int i = 0; i < rec->opCount; i++) {
+            if (rec->ops[i].offset == next) return false;
+        }
+        offset = next;
+    }
+
+#undef POP
+#undef PUSH
+}
+
+static Known unknownValue(void) {
+    Known known = {false, false, NIL_VAL};
+    return known;
+}
+
+static Known numberValue(void) {
+    Known known = {true, false, NIL_VAL};
+    return known;
+}
+
+static Known constantValue(Value value) {
+    Known known = {IS_NUMBER(value), true, value};
+    return known;
+}
+
+static bool constantNumbers(Known* a, Known* b) {
+    return a->constant && b->constant && a->number && b->number;
+}
+
+typedef struct {
+    Recorder* rec;
+    Assembler* as;
+    Known frame[UINT8_COUNT + TRACE_MAX_OPS];
+    int top;
+    int maxTop;
+} TraceCompiler;
+
+static TraceGlobal* knownGlobal(TraceCompiler* tc, int slot) {
+    for (int i = 0; i < tc->rec->globalCount; i++) {
+        if (tc->rec->globals[i].slot == slot) return &tc->rec->globals[i];
+    }
+    return NULL;
+}
+
+static void guardUnlessNumber(Assembler* as, Known* known, int reg, int offset) {
+    if (!known->number) guardNumber(as, reg, offset);
+}
+
+// replace an instruction's operands on the stack with its folded result.
+static void foldTo(TraceCompiler* tc, int operands, Value value) {
+    loadImmediate(tc->as, RAX, value);
+    storeStack(tc->as, RAX, operands);
+    if (operands > 1) adjustStack(tc->as, 1 - operands);
+    tc->top -= operands - 1;
+    tc->frame[tc->top - 1] = constantValue(value);
+}
+
+// compile one recorded instruction, with guards only for what isn't known.
+static void traceInstruction(TraceCompiler* tc, TraceOp* op) {
+    Assembler* as = tc->as;
+    Chunk* chunk = as->chunk;
+    Known* frame = tc->frame;
+    int offset = op->offset;
+    uint8_t* code = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+
+    switch (code[0]) {
+        case OP_CONSTANT:
+            emitInstruction(as, offset);
+            frame[tc->top++] = constantValue(chunk->constants.values[code[1]]);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            emitInstruction(as, offset);
+            frame[tc->top++] = constantValue(code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE));
+            break;
+        case OP_POP:
+            emitInstruction(as, offset);
+            tc->top--;
+            break;
+        case OP_GET_LOCAL:
+            emitInstruction(as, offset);
+            frame[tc->top] = frame[code[1]];
+            tc->top++;
+            break;
+        case OP_SET_LOCAL:
+            emitInstruction(as, offset);
+            frame[code[1]] = frame[tc->top - 1];
+            break;
+        case OP_GET_GLOBAL: {
+            TraceGlobal* global = knownGlobal(tc, (code[1] << 8) | code[2]);
+            if (global->known.number) {
+                // a number isn't undefined.
+                loadGlobals(as);
+                emitCode(as, 3, 0x48, 0x8b, 0x80);      // mov rax, [rax + disp32]
+                emit32(as, 8 * global->slot);
+                pushRegister(as, RAX);
+            } else {
+                emitInstruction(as, offset);
+            }
+            frame[tc->top++] = global->known;
+            break;
+        }
+        case OP_SET_GLOBAL: {
+            TraceGlobal* global = knownGlobal(tc, (code[1] << 8) | code[2]);
+            if (global->known.number) {
+                loadGlobals(as);
+                loadStack(as, RCX, 1);
+                emitCode(as, 3, 0x48, 0x89, 0x88);      // mov [rax + disp32], rcx
+                emit32(as, 8 * global->slot);
+            } else {
+                emitInstruction(as, offset);
+            }
+            global->known = frame[tc->top - 1];
+            break;
+        }
+        case OP_EQUAL: {
+            Known* a = &frame[tc->top - 2];
+            Known* b = &frame[tc->top - 1];
+            if (a->constant && b->constant) {
+                foldTo(tc, 2, BOOL_VAL(valuesEqual(a->value, b->value)));
+            } else {
+                emitEqual(as);
+                tc->top--;
+                frame[tc->top - 1] = unknownValue();
+            }
+            break;
+        }
+        case OP_GREATER:
+        case OP_LESS: {
+            Known* a = &frame[tc->top - 2];
+            Known* b = &frame[tc->top - 1];
+            if (constantNumbers(a, b)) {
+                double x = AS_NUMBER(a->value);
+                double y = AS_NUMBER(b->value);
+                foldTo(tc, 2, BOOL_VAL(code[0] == OP_GREATER ? x > y : x < y));
+            } else {
+                loadStackNumbers(as, !a->number, !b->number, offset);
+                if (code[0] == OP_GREATER) {
+                    compareDoubles(as, 0, 1);
+                } else {
+                    compareDoubles(as, 1, 0);
+                }
+                emitBoolFromFlags(as, CC_A);
+                storeStack(as, RAX, 2);
+                adjustStack(as, -1);
+                tc->top--;
+                frame[tc->top - 1] = unknownValue();
+            }
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_ADD_GENERIC:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            Known* a = &frame[tc->top - 2];
+            Known* b = &frame[tc->top - 1];
+            uint8_t sseOp = arithmeticOp(code[0]);
+            if (constantNumbers(a, b)) {
+                foldTo(tc, 2, NUMBER_VAL(foldArithmetic(sseOp, AS_NUMBER(a->value), AS_NUMBER(b->value))));
+            } else {
+                loadStack(as, RAX, 2);
+                loadStack(as, RCX, 1);
+                guardUnlessNumber(as, a, RAX, offset);
+                guardUnlessNumber(as, b, RCX, offset);
+                emitDoubleOp(as, sseOp);
+                storeStack(as, RAX, 2);
+                adjustStack(as, -1);
+                tc->top--;
+                frame[tc->top - 1] = numberValue();
+            }
+            break;
+        }
+        case OP_NOT: {
+            Known* a = &frame[tc->top - 1];
+            if (a->number) {
+                foldTo(tc, 1, BOOL_VAL(false));
+            } else if (a->constant) {
+                foldTo(tc, 1, BOOL_VAL(isFalsey(a->value)));
+            } else {
+                emitNot(as);
+            }
+            break;
+        }
+        case OP_NEGATE: {
+            Known* a = &frame[tc->top - 1];
+            if (a->constant && a->number) {
+                foldTo(tc, 1, NUMBER_VAL(-AS_NUMBER(a->value)));
+            } else {
+                loadStack(as, RAX, 1);
+                guardUnlessNumber(as, a, RAX, offset);
+                emitCode(as, 5, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+                storeStack(as, RAX, 1);
+                frame[tc->top - 1] = numberValue();
+            }
+            break;
+        }
+        case OP_JUMP:
+        case OP_LOOP:
+            // the trace carries straight on at the target.
+            break;
+        case OP_JUMP_IF_FALSE: {
+            Known* a = &frame[tc->top - 1];
+            if (a->number || a->constant) break;
+
+            // leave for the path the recorded iteration didn't take.
+            int target = next + ((code[1] << 8) | code[2]);
+            loadStack(as, RAX, 1);
+            loadImmediate(as, RCX, NIL_VAL);
+            emitCode(as, 3, 0x48, 0x39, 0xc8);          // cmp rax, rcx
+            if (op->taken) {
+                int isNil = emitShortJump(as, 0x74);
+                loadImmediate(as, RCX, FALSE_VAL);
+                emitCode(as, 3, 0x48, 0x39, 0xc8);
+                int isFalse = emitShortJump(as, 0x74);
+                emitBail(as, -1, next);
+                patchShortJump(as, isNil);
+                patchShortJump(as, isFalse);
+            } else {
+                emitBail(as, CC_E, target);
+                loadImmediate(as, RCX, FALSE_VAL);
+                emitCode(as, 3, 0x48, 0x39, 0xc8);
+                emitBail(as, CC_E, target);
+            }
+            break;
+        }
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_LESS_CONSTANT: {
+            bool constant = code[0] == OP_JUMP_IF_NOT_LESS_CONSTANT;
+            int operands = constant ? 1 : 2;
+            int target = next + (constant ? ((code[2] << 8) | code[3]) : ((code[1] << 8) | code[2]));
+            Known* a = &frame[tc->top - operands];
+            Known b = constant ? constantValue(chunk->constants.values[code[1]]) : frame[tc->top - 1];
+            tc->top -= operands;
+
+            // with both operands known the branch always goes the recorded way.
+            if (constantNumbers(a, &b)) {
+                adjustStack(as, -operands);
+                break;
+            }
+
+            if (constant) {
+                loadStack(as, RAX, 1);
+                guardUnlessNumber(as, a, RAX, offset);
+                moveToDouble(as, 0, RAX);
+                loadImmediate(as, RCX, b.value);
+                moveToDouble(as, 1, RCX);
+            } else {
+                loadStackNumbers(as, !a->number, !b.number, offset);
+            }
+            adjustStack(as, -operands);
+            int condition = emitBranchCompare(as, constant ? OP_JUMP_IF_NOT_LESS : code[0]);
+            if (op->taken) {
+                emitBail(as, condition ^ 1, next);
+            } else {
+                emitBail(as, condition, target);
+            }
+            break;
+        }
+        case OP_ADD_LOCALS:
+        case OP_ADD_RR:
+        case OP_SUBTRACT_RR:
+        case OP_MULTIPLY_RR:
+        case OP_DIVIDE_RR:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK: {
+            bool push = code[0] == OP_ADD_LOCALS;
+            bool constant = code[0] >= OP_ADD_RK;
+            int aSlot = push ? code[1] : code[2];
+            int bSlot = push ? code[2] : code[3];
+            Known a = frame[aSlot];
+            Known b = constant ? constantValue(chunk->constants.values[bSlot]) : frame[bSlot];
+            uint8_t sseOp = arithmeticOp(code[0]);
+
+            Known result;
+            if (constantNumbers(&a, &b)) {
+                Value value = NUMBER_VAL(foldArithmetic(sseOp, AS_NUMBER(a.value), AS_NUMBER(b.value)));
+                loadImmediate(as, RAX, value);
+                result = constantValue(value);
+            } else {
+                loadLocal(as, RAX, aSlot);
+                if (constant) {
+                    loadImmediate(as, RCX, b.value);
+                } else {
+                    loadLocal(as, RCX, bSlot);
+                }
+                guardUnlessNumber(as, &a, RAX, offset);
+                guardUnlessNumber(as, &b, RCX, offset);
+                emitDoubleOp(as, sseOp);
+                result = numberValue();
+            }
+
+            if (push) {
+                pushRegister(as, RAX);
+                frame[tc->top++] = result;
+            } else {
+                storeLocal(as, RAX, code[1]);
+                frame[code[1]] = result;
+            }
+            break;
+        }
+    }
+
+    if (tc->top > tc->maxTop) tc->maxTop = tc->top;
+}
+
+// assemble a recorded trace, assuming its invariant locals and globals are
+// numbers at the top of every iteration.
+// Returns: false if an assumption didn't survive the iteration; it has been
+// dropped and the trace must be assembled again.
+static bool assembleTrace(Recorder* rec, Assembler* as, int* entry, int* maxPush) {
+    TraceCompiler tc;
+    tc.rec = rec;
+    tc.as = as;
+    tc.top = rec->base;
+    tc.maxTop = rec->base;
+
+    emitPrologue(as);
+    *entry = as->count;
+
+    // check the assumptions once, leaving for the interpreter at the header
+    // if they don't hold.
+    for (int slot = 0; slot < rec->base; slot++) {
+        tc.frame[slot] = rec->invariant[slot] ? numberValue() : unknownValue();
+        if (rec->invariant[slot]) {
+            loadLocal(as, RAX, slot);
+            guardNumber(as, RAX, rec->header);
+        }
+    }
+    for (int i = 0; i < rec->globalCount; i++) {
+        TraceGlobal* global = &rec->globals[i];
+        global->known = global->invariant ? numberValue() : unknownValue();
+        if (global->invariant) {
+            loadGlobals(as);
+            emitCode(as, 3, 0x48, 0x8b, 0x80);          // mov rax, [rax + disp32]
+            emit32(as, 8 * global->slot);
+            guardNumber(as, RAX, rec->header);
+        }
+    }
+
+    int loopTop = as->count;
+    for (int i = 0; i < rec->opCount - 1; i++) traceInstruction(&tc, &rec->ops[i]);
+    emit(as, 0xe9);                                     // jmp loopTop
+    emit32(as, loopTop - (as->count + 4));
+
+    bool held = true;
+    for (int slot = 0; slot < rec->base; slot++) {
+        if (rec->invariant[slot] && !tc.frame[slot].number) {
+            rec->invariant[slot] = false;
+            held = false;
+        }
+    }
+    for (int i = 0; i < rec->globalCount; i++) {
+        if (rec->globals[i].invariant && !rec->globals[i].known.number) {
+            rec->globals[i].invariant = false;
+            held = false;
+        }
+    }
+
+    emitBailExits(as);
+    *maxPush = tc.maxTop - rec->base;
+    return held;
+}
+
+// record and compile a trace for a hot loop.
+// Returns: false if the loop couldn't be traced this time.
+static bool compileTrace(ObjFunction* function, LoopTrace* trace, Value* slots) {
+    Recorder rec;
+    rec.function = function;
+    rec.header = trace->header;
+    rec.base = (int)(vm.stackTop - slots);
+    rec.opCount = 0;
+    rec.globalCount = 0;
+    memset(rec.invariant, 0, sizeof(rec.invariant));
+    if (rec.base > UINT8_COUNT || !recordTrace(&rec, slots)) return false;
+
+    // each failed assembly drops at least one assumption, so this ends.
+    for (;;) {
+        Assembler as;
+        memset(&as, 0, sizeof(as));
+        as.function = function;
+        as.chunk = &function->chunk;
+
+        int entry;
+        int maxPush;
+        if (assembleTrace(&rec, &as, &entry, &maxPush)) {
+            trace->code = mapCode(&as);
+            trace->size = (size_t)as.count;
+            trace->entry = entry;
+            trace->maxPush = maxPush;
+            freeAssembler(&as);
+            return trace->code != NULL;
+        }
+        freeAssembler(&as);
+    }
+}
+
+int traceLoop(ObjFunction* function, int header, Value* slots) {
+    LoopTrace* trace = findTrace(function, header);
+    if (trace == NULL) {
+        if (function->traceCapacity < function->traceCount + 1) {
+            int oldCapacity = function->traceCapacity;
+            function->traceCapacity = GROW_CAPACITY(oldCapacity);
+            function->traces = GROW_ARRAY(LoopTrace, function->traces, oldCapacity, function->traceCapacity);
+        }
+        trace = &function->traces[function->traceCount++];
+        memset(trace, 0, sizeof(LoopTrace));
+        trace->header = header;
+    }
+
+    if (trace->code == NULL) {
+        if (trace->attempts >= TRACE_ATTEMPTS || ++trace->hotness < TRACE_THRESHOLD) return header;
+
+        trace->hotness = 0;
+        if (!compileTrace(function, trace, slots)) {
+            trace->attempts++;
+            return header;
+        }
+    }
+
+    if (vm.stackTop + trace->maxPush > vm.stack + vm.frameCapacity * FRAME_SLOTS) return header;
+
+    JitFunction native = (JitFunction)(void*)trace->code;
+    return native(slots, vm.stackTop, trace->code + trace->entry);
+}
+
+void freeJit(ObjFunction* function) {
+    JitCode* jit = function->jit;
+    if (jit != NULL) {
+        munmap(jit->code, jit->size);
+        FREE_ARRAY(int, jit->entries, jit->entryCount);
+        FREE(JitCode, jit);
+    }
+
+    for (int i = 0; i < function->traceCount; i++) {
+        if (function->traces[i].code != NULL) munmap(function->traces[i].code, function->traces[i].size);
+    }
+    FREE_ARRAY(LoopTrace, function->traces, function->traceCapacity);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+
+#ifdef JIT
+
+// calls plus loop backedges before a function is compiled to native code.
+#define JIT_THRESHOLD 1000
+
+// native code for one function.
+typedef struct JitCode {
+    uint8_t* code;      // executable memory.
+    size_t size;        // size of the mapping.
+    int* entries;       // bytecode offset -> offset into code, -1 between instructions.
+    int entryCount;     // the size of the chunk.
+    int maxPush;        // most values the native code can push past where it was entered.
+} JitCode;
+
+// backedges a loop takes in the interpreter before it is traced.
+#define TRACE_THRESHOLD 100
+
+// recordings of a loop that may fail (because the loop was about to end)
+// before it is left to the interpreter and the baseline JIT for good.
+#define TRACE_ATTEMPTS 8
+
+// most instructions in one trace.
+#define TRACE_MAX_OPS 256
+
+// a hot loop and the native trace compiled for it.
+typedef struct LoopTrace {
+    int header;         // bytecode offset the loop's backedge jumps to.
+    int hotness;        // backedges taken while interpreted.
+    int attempts;       // recordings that didn't produce a trace.
+    uint8_t* code;      // executable memory, or NULL until compiled.
+    size_t size;        // size of the mapping.
+    int entry;          // offset of the entry point in code.
+    int maxPush;        // most values the trace can push past its entry.
+} LoopTrace;
+
+// compile a hot function to native code.
+void compileJit(ObjFunction* function);
+
+// run a function's native code from a bytecode offset, until it reaches an
+// instruction it leaves to the interpreter.
+// Returns: the bytecode offset to carry on interpreting from.
+int enterJit(ObjFunction* function, int offset, Value* slots);
+
+// count a backedge to a loop header, tracing the loop once it's hot, and
+// run the loop's trace if it has one.
+// Arguments:
+//  function - the function the loop is in.
+//  header - bytecode offset the backedge jumps to.
+//  slots - the frame's slots.
+// Returns: the bytecode offset to carry on interpreting from.
+int traceLoop(ObjFunction* function, int header, Value* slots);
+
+// free a function's native code and traces.
+void freeJit(ObjFunction* function);
+
+#endif
+
+#endif
@@ -69,21 +69,50 @@ static void runFile(const char* path) {
     }
 }
 
+// report how long the program spent paused for garbage collection.
+static void printGcStats() {
+    fprintf(stderr, "gc: %d pauses, %.3f ms total, %.3f ms max\n",
+            vm.gcPauses, vm.gcTotalPause * 1000, vm.gcMaxPause * 1000);
+}
+
 // Main routine.
 // If no arguments, runs the REPL.
 // If one argument, that's the name of a script file to interpret.
+// Options before either:
+//  --no-jit keeps hot functions in the interpreter.
+//  --gc-budget=n marks n objects per slice of a full collection, 0
+//      marking in one pause.
+//  --gc-threads=n marks large heaps on n threads, by default one per core.
+//  --gc-stats prints the collector's pause times on exit.
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    bool gcStats = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--no-jit") == 0) {
+            vm.jitEnabled = false;
+        } else if (strncmp(argv[arg], "--gc-budget=", 12) == 0) {
+            vm.gcBudget = atoi(argv[arg] + 12);
+        } else if (strncmp(argv[arg], "--gc-threads=", 13) == 0) {
+            vm.gcThreads = atoi(argv[arg] + 13);
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            gcStats = true;
+        } else {
+            break;
+        }
+    }
+
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--no-jit] [--gc-budget=n] [--gc-threads=n] [--gc-stats] [path]\n");
         exit(64);
     }
-    
+
+    if (gcStats) printGcStats();
     freeVM();
     return 0;
 }
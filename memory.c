@@ -1,6 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -9,20 +12,110 @@
 #include "debug.h"
 #endif
 
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
 
-// Our one memory allocation routine, which will grow as needed and also free if nothing is to be allocated.
-void* reallocate( void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+// bytes allocated between minor collections.
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
 
-    if (newSize > oldSize) {
+// slots swept at each allocation after a full collection has marked.
+// Stress runs sweep a page at a time, so full collections come round often.
 #ifdef DEBUG_STRESS_GC
-        collectGarbage();
+#define SWEEP_WORK PAGE_SLOTS_MAX
+#else
+#define SWEEP_WORK 16
 #endif
-    }
-    if (vm.bytesAllocated > vm.nextGC) {
+
+// bytes in a page of object slots. Pages are aligned to their size, so the
+// page an object is in is found by masking its address.
+#define PAGE_SIZE (64 * 1024)
+
+// objects go in slots rounded up to a multiple of SLOT_ALIGN bytes, one
+// size class per multiple up to SLOT_SIZE_MAX.
+#define SLOT_ALIGN 16
+#define SIZE_CLASS_COUNT (SLOT_SIZE_MAX / SLOT_ALIGN)
+#define PAGE_SLOTS_MAX (PAGE_SIZE / SLOT_ALIGN)
+
+// a free slot, linked into its page's free list.
+typedef struct FreeSlot {
+    struct FreeSlot* next;
+} FreeSlot;
+
+// a page of equal-sized slots for objects of one size class.
+typedef struct Page {
+    struct Page* previous;      // neighbours in its size class's list.
+    struct Page* next;
+    struct Page* nextYoung;     // next page in heap.youngPages.
+    FreeSlot* freeSlots;
+    int sizeClass;
+    int slotSize;
+    int slotCount;
+    int liveCount;              // slots holding objects.
+    uint32_t slotReciprocal;    // 2^32 / slotSize rounded up, to find a slot's index without dividing.
+    uint32_t sweepEpoch;        // the last full collection whose sweep it has had.
+    bool isYoung;               // in heap.youngPages.
+    // one bit per slot each. Marks are kept here rather than in the objects,
+    // so marking and sweeping don't write to live objects' memory, which
+    // stays clean (and shared with forked processes).
+    uint64_t allocated[PAGE_SLOTS_MAX / 64];  // holds an object.
+    uint64_t marked[PAGE_SLOTS_MAX / 64];     // reached by the collection marking.
+    uint64_t young[PAGE_SLOTS_MAX / 64];      // allocated since the last collection.
+} Page;
+
+// offset of the first slot in a page.
+#define PAGE_HEADER ((sizeof(Page) + SLOT_ALIGN - 1) & ~(size_t)(SLOT_ALIGN - 1))
+
+// the pages of one size class, and the one slots are being taken from.
+typedef struct {
+    Page* pages;
+    Page* current;
+} SizeClass;
+
+// every object lives in a slot of some page here.
+typedef struct {
+    SizeClass classes[SIZE_CLASS_COUNT];
+    Page* youngPages;           // pages given objects since the last collection.
+    uint32_t sweepEpoch;        // counts full collections that have finished marking.
+    int sweepClass;             // where a pending sweep has got to.
+    Page* sweepPage;
+    int sweepCredit;            // slots the allocations since have paid for it to sweep.
+} Heap;
+
+static Heap heap;
+
+static void sweepLazily();
+
+// count memory being allocated, collecting garbage first when it's time to.
+static void countAllocation(size_t size) {
+    vm.bytesAllocated += size;
+    vm.youngBytes += size;
+    vm.sliceBytes += size;
+    if (vm.gcPhase == GC_SWEEP) sweepLazily();
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#endif
+    if (vm.youngBytes > NURSERY_SIZE ||
+        (vm.gcPhase == GC_IDLE && vm.bytesAllocated > vm.nextGC) ||
+        (vm.gcPhase == GC_MARK && vm.sliceBytes > GC_SLICE_BYTES)) {
         collectGarbage();
     }
+}
+
+// Our one memory allocation routine, which will grow as needed and also free if nothing is to be allocated.
+void* reallocate( void* pointer, size_t oldSize, size_t newSize) {
+    // only collect when growing - freeing happens inside sweep() itself.
+    if (newSize > oldSize) {
+        countAllocation(newSize - oldSize);
+    } else {
+        vm.bytesAllocated -= oldSize - newSize;
+    }
 
     if (newSize == 0) {
         free(pointer);
@@ -34,12 +127,269 @@ void* reallocate( void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+static Page* pageOf(Obj* object) {
+    return (Page*)((uintptr_t)object & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static Obj* slotAt(Page* page, int index) {
+    return (Obj*)((uint8_t*)page + PAGE_HEADER + (size_t)index * page->slotSize);
+}
+
+// exact, since slot offsets are under 2^16 and slot sizes at most 2^8.
+static int slotIndex(Page* page, Obj* object) {
+    uint64_t offset = (uint64_t)((uint8_t*)object - (uint8_t*)slotAt(page, 0));
+    return (int)((offset * page->slotReciprocal) >> 32);
+}
+
+#define SLOT_BIT(index) ((uint64_t)1 << ((index) % 64))
+
+static int lowestBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// call a function on each object in a word of a page's slots whose bit is set.
+// It may free the object.
+static void visitSlots(Page* page, int word, uint64_t bits, void (*visit)(Obj*)) {
+    while (bits != 0) {
+        int index = word * 64 + lowestBit(bits);
+        bits &= bits - 1;
+        visit(slotAt(page, index));
+    }
+}
+
+static Page* newPage(int sizeClass) {
+#ifdef _MSC_VER
+    Page* page = (Page*)_aligned_malloc(PAGE_SIZE, PAGE_SIZE);
+#else
+    Page* page = (Page*)aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+#endif
+    if (page == NULL) exit(1);
+
+    page->sizeClass = sizeClass;
+    page->slotSize = (sizeClass + 1) * SLOT_ALIGN;
+    page->slotCount = (int)((PAGE_SIZE - PAGE_HEADER) / page->slotSize);
+    page->liveCount = 0;
+    page->slotReciprocal = (uint32_t)(((uint64_t)1 << 32) / page->slotSize + 1);
+    page->sweepEpoch = heap.sweepEpoch;
+    page->isYoung = false;
+    page->nextYoung = NULL;
+    memset(page->allocated, 0, sizeof(page->allocated));
+    memset(page->marked, 0, sizeof(page->marked));
+    memset(page->young, 0, sizeof(page->young));
+
+    // free list in address order.
+    page->freeSlots = NULL;
+    for (int i = page->slotCount - 1; i >= 0; i--) {
+        FreeSlot* slot = (FreeSlot*)slotAt(page, i);
+        slot->next = page->freeSlots;
+        page->freeSlots = slot;
+    }
+
+    SizeClass* pages = &heap.classes[sizeClass];
+    page->previous = NULL;
+    page->next = pages->pages;
+    if (page->next != NULL) page->next->previous = page;
+    pages->pages = page;
+    return page;
+}
+
+static void freePage(Page* page) {
+    SizeClass* pages = &heap.classes[page->sizeClass];
+    if (page->previous != NULL) {
+        page->previous->next = page->next;
+    } else {
+        pages->pages = page->next;
+    }
+    if (page->next != NULL) page->next->previous = page->previous;
+    if (pages->current == page) pages->current = page->next;
+
+#ifdef _MSC_VER
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+// allocation takes slots from the first pages with free ones again, after a
+// collection may have freed some behind where it had got to.
+static void rewindAllocation() {
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        heap.classes[i].current = heap.classes[i].pages;
+    }
+}
+
+static void sweepPage(Page* page);
+
+// allocate a slot for an object from the pages of its size class. A page
+// a pending sweep hasn't reached is swept first, so new objects are never
+// swept by a collection that didn't mark them.
+void* allocateSlot(size_t size) {
+    int sizeClass = (int)((size + SLOT_ALIGN - 1) / SLOT_ALIGN) - 1;
+    countAllocation((size_t)(sizeClass + 1) * SLOT_ALIGN);
+
+    SizeClass* pages = &heap.classes[sizeClass];
+    Page* page = pages->current;
+    while (page != NULL) {
+        if (page->sweepEpoch != heap.sweepEpoch) sweepPage(page);
+        if (page->freeSlots != NULL) break;
+        page = page->next;
+    }
+    if (page == NULL) page = newPage(sizeClass);
+    pages->current = page;
+
+    FreeSlot* slot = page->freeSlots;
+    page->freeSlots = slot->next;
+    int index = slotIndex(page, (Obj*)slot);
+    page->allocated[index / 64] |= SLOT_BIT(index);
+    page->young[index / 64] |= SLOT_BIT(index);
+    page->liveCount++;
+
+    if (!page->isYoung) {
+        page->isYoung = true;
+        page->nextYoung = heap.youngPages;
+        heap.youngPages = page;
+    }
+    return slot;
+}
+
+// give a freed object's slot back to its page.
+static void releaseSlot(Obj* object) {
+    Page* page = pageOf(object);
+    int index = slotIndex(page, object);
+    page->allocated[index / 64] &= ~SLOT_BIT(index);
+    page->young[index / 64] &= ~SLOT_BIT(index);
+#ifdef DEBUG_STRESS_GC
+    // so a dangling reference fails loudly instead of reading a stale object.
+    memset(object, 0xdd, page->slotSize);
+#endif
+    FreeSlot* slot = (FreeSlot*)object;
+    slot->next = page->freeSlots;
+    page->freeSlots = slot;
+    page->liveCount--;
+    vm.bytesAllocated -= page->slotSize;
+}
+
+#ifdef PARALLEL_MARK
+// most threads marking at once.
+#define MARK_THREADS_MAX 16
+
+// objects the serial trace blackens before handing the rest to the threads.
+#define PARALLEL_MARK_MIN 4096
+
+// gray objects a thread shares for stealing (a power of two).
+#define MARK_DEQUE_SIZE 4096
+
+// a thread marking in parallel. It pushes and pops gray objects at the
+// bottom of its deque while idle threads steal from the top (a Chase-Lev
+// deque); what doesn't fit stays private in its overflow stack.
+typedef struct {
+    Obj* items[MARK_DEQUE_SIZE];
+    long top;
+    long bottom;
+    Obj** overflow;
+    int overflowCount;
+    int overflowCapacity;
+    int index;
+    pthread_t thread;
+} MarkWorker;
+
+static MarkWorker markWorkers[MARK_THREADS_MAX];
+static int markWorkerCount;
+static int idleWorkers;                 // threads out of work.
+static __thread MarkWorker* markWorker; // this thread's, while marking in parallel.
+
+static bool pushDeque(MarkWorker* worker, Obj* object) {
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= MARK_DEQUE_SIZE) return false;
+
+    __atomic_store_n(&worker->items[bottom & (MARK_DEQUE_SIZE - 1)], object, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static Obj* popDeque(MarkWorker* worker) {
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&worker->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Obj* object = __atomic_load_n(&worker->items[bottom & (MARK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // the last one: race any thief for it.
+        if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            object = NULL;
+        }
+        __atomic_store_n(&worker->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return object;
+}
+
+static Obj* stealDeque(MarkWorker* worker) {
+    long top = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) return NULL;
+
+    Obj* object = __atomic_load_n(&worker->items[top & (MARK_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&worker->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return object;
+}
+
+// give a thread a gray object, sharing it if its deque has room.
+static void pushGray(MarkWorker* worker, Obj* object) {
+    if (pushDeque(worker, object)) return;
+
+    if (worker->overflowCapacity < worker->overflowCount + 1) {
+        worker->overflowCapacity = GROW_CAPACITY(worker->overflowCapacity);
+        worker->overflow = (Obj**)realloc(worker->overflow, sizeof(Obj*) * worker->overflowCapacity);
+
+        if (worker->overflow == NULL) exit(1);
+    }
+    worker->overflow[worker->overflowCount++] = object;
+}
+#endif
+
 void markObject(Obj* object) {
     // nothing if already freed
     if (object == NULL) return;
 
+    // a minor collection takes every old object to be live.
+    if (vm.collectingYoung && object->isOld) return;
+
+    Page* page = pageOf(object);
+    int index = slotIndex(page, object);
+    uint64_t* marks = &page->marked[index / 64];
+    uint64_t bit = SLOT_BIT(index);
+
+#ifdef PARALLEL_MARK
+    if (markWorker != NULL) {
+        // another thread may be marking this object, or one beside it.
+        if (__atomic_fetch_or(marks, bit, __ATOMIC_RELAXED) & bit) return;
+        pushGray(markWorker, object);
+        return;
+    }
+#endif
+
     // avoid cycles
-    if (object->isMarked) return;
+    if (*marks & bit) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -48,7 +398,7 @@ void markObject(Obj* object) {
 #endif
     
     // mark the object
-    object->isMarked = true;
+    *marks |= bit;
 
     // add to the gray list
     if (vm.grayCapacity < vm.grayCount + 1) {
@@ -60,6 +410,30 @@ void markObject(Obj* object) {
     vm.grayStack[vm.grayCount++] = object;
 }
 
+bool isMarkedObject(Obj* object) {
+    Page* page = pageOf(object);
+    int index = slotIndex(page, object);
+    return (page->marked[index / 64] & SLOT_BIT(index)) != 0;
+}
+
+// add an old object to the remembered set.
+void rememberObject(Obj* object) {
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// has the collection in progress reached an object? Old objects are out of
+// a minor collection's reach, so they count.
+bool isReached(Obj* object) {
+    return isMarkedObject(object) || (vm.collectingYoung && object->isOld);
+}
+
 void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
@@ -70,56 +444,72 @@ static void markArray(ValueArray* array) {
     }
 }
 
+// the inline caches hold strong references, so a cached class or layout
+// can't be freed and have its address reused by something else.
+static void markInlineCaches(Chunk* chunk) {
+    for (int i = 0; i < chunk->cacheCount; i++) {
+        InlineCache* cache = &chunk->caches[i];
+        for (int j = 0; j < cache->count; j++) {
+            CacheEntry* entry = &cache->entries[j];
+            markObject((Obj*)entry->shape);
+            markObject((Obj*)entry->klass);
+            markObject((Obj*)entry->target);
+            markObject((Obj*)entry->method);
+        }
+    }
+}
+
+// free what an object owns and give its slot back.
 static void freeObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
 #endif
     
     switch (object->type) {
-        case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
-            break;
-        }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeMethods(klass);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT
+            freeJit(function);
+#endif
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            if (instance->bound != NULL) {
+                freeValueArray(instance->bound);
+                FREE(ValueArray, instance->bound);
+            }
             break;
         }
-        case OBJ_NATIVE: {
-            FREE(ObjNative, object);
-            break;   
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            break;
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
             break;
         }
-        case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
             break;
-        }
-
     }
+    releaseSlot(object);
 }
 
 // blacken gray objects.
@@ -139,7 +529,13 @@ static void blackenObject(Obj* object) {
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject((Obj*)klass->initializer);
+            for (int i = 0; i < klass->pageCount; i++) {
+                if (klass->pages[i] == NULL) continue;
+                for (int j = 0; j < METHOD_PAGE_SIZE; j++) {
+                    markObject((Obj*)klass->pages[i]->methods[j]);
+                }
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -154,12 +550,23 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            markInlineCaches(&function->chunk);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject((Obj*)instance->shape);
+            if (instance->bound != NULL) markArray(instance->bound);
+            for (int i = 0; i < instance->shape->fieldCount; i++) {
+                markValue(instance->fields[i]);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE: {
@@ -183,53 +590,326 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    markArray(&vm.methodNames);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.emptyShape);
+}
+
+#ifdef PARALLEL_MARK
+// a thread's next gray object: its own, or else one stolen from another thread.
+static Obj* nextGray(MarkWorker* worker) {
+    Obj* object = popDeque(worker);
+    if (object != NULL) return object;
+
+    if (worker->overflowCount > 0) {
+        // refill the deque, so the others have something to steal.
+        while (worker->overflowCount > 1 &&
+               pushDeque(worker, worker->overflow[worker->overflowCount - 1])) {
+            worker->overflowCount--;
+        }
+        return worker->overflow[--worker->overflowCount];
+    }
+
+    for (int i = 1; i < markWorkerCount; i++) {
+        MarkWorker* victim = &markWorkers[(worker->index + i) % markWorkerCount];
+        object = stealDeque(victim);
+        if (object != NULL) return object;
+    }
+    return NULL;
+}
+
+static bool canSteal() {
+    for (int i = 0; i < markWorkerCount; i++) {
+        MarkWorker* worker = &markWorkers[i];
+        if (__atomic_load_n(&worker->top, __ATOMIC_ACQUIRE) <
+            __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
 }
 
+// blacken gray objects until every thread is out of them. A thread only
+// gives up once it has none of its own and there is nothing to steal, so
+// when all have given up the marking is done.
+static void* markInParallel(void* argument) {
+    MarkWorker* worker = (MarkWorker*)argument;
+    markWorker = worker;
+
+    for (;;) {
+        Obj* object;
+        while ((object = nextGray(worker)) != NULL) {
+            blackenObject(object);
+        }
+
+        __atomic_add_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&idleWorkers, __ATOMIC_SEQ_CST) == markWorkerCount) {
+                markWorker = NULL;
+                return NULL;
+            }
+            if (canSteal()) break;
+            sched_yield();
+        }
+        __atomic_sub_fetch(&idleWorkers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// threads to mark with: vm.gcThreads, or one per core.
+static int markThreads() {
+    int threads = vm.gcThreads;
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MARK_THREADS_MAX) threads = MARK_THREADS_MAX;
+    return threads;
+}
+
+// share out the gray stack and trace from it on several threads, this one
+// included.
+static void traceParallel(int threads) {
+    markWorkerCount = threads;
+    idleWorkers = 0;
+    for (int i = 0; i < threads; i++) {
+        MarkWorker* worker = &markWorkers[i];
+        worker->top = 0;
+        worker->bottom = 0;
+        worker->overflowCount = 0;
+        worker->index = i;
+    }
+    for (int i = 0; i < vm.grayCount; i++) {
+        pushGray(&markWorkers[i % threads], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&markWorkers[i].thread, NULL, markInParallel, &markWorkers[i]) != 0) exit(1);
+    }
+
+    markInParallel(&markWorkers[0]);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(markWorkers[i].thread, NULL);
+    }
+}
+#endif
+
 static void traceReferences() {
+#ifdef PARALLEL_MARK
+    // a small trace isn't worth starting threads for, so begin on this
+    // one and hand over once it has proved big enough.
+    int threads = markThreads();
+    int serial = 0;
     while (vm.grayCount > 0) {
+        if (threads > 1 && serial++ == PARALLEL_MARK_MIN) {
+            traceParallel(threads);
+            return;
+        }
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
     }
+#else
+    while (vm.grayCount > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+#endif
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
-            freeObject(unreached);
+static void promoteObject(Obj* object) {
+    object->isOld = true;
+}
+
+// sweep a page for the full collection that last finished marking, 64 slots
+// at a time: free the unmarked objects, promote the young ones that were
+// marked, and clear the marks. Old survivors aren't touched.
+static void sweepPage(Page* page) {
+    for (int word = 0; word * 64 < page->slotCount; word++) {
+        uint64_t marked = page->marked[word];
+        visitSlots(page, word, page->allocated[word] & ~marked, freeObject);
+        visitSlots(page, word, page->young[word] & marked, promoteObject);
+        page->young[word] = 0;
+        page->marked[word] = 0;
+    }
+    page->sweepEpoch = heap.sweepEpoch;
+}
+
+// free the young objects that weren't reached and promote the rest to old.
+// They're all in the pages allocated from since the last collection.
+static void sweepYoung() {
+    for (Page* page = heap.youngPages; page != NULL; page = page->nextYoung) {
+        for (int word = 0; word * 64 < page->slotCount; word++) {
+            uint64_t young = page->young[word];
+            if (young == 0) continue;
+            uint64_t marked = page->marked[word] & young;
+            visitSlots(page, word, young & ~marked, freeObject);
+            visitSlots(page, word, marked, promoteObject);
+            page->young[word] = 0;
+            page->marked[word] &= ~young;
+        }
+        page->isYoung = false;
+    }
+    heap.youngPages = NULL;
+    vm.youngBytes = 0;
+    rewindAllocation();
+}
+
+// the next page a pending sweep hasn't reached, or NULL once it has
+// swept them all. Allocation sweeps some itself, and adds new pages at the
+// front of their lists, behind where the sweep starts.
+static Page* nextUnsweptPage() {
+    while (heap.sweepClass < SIZE_CLASS_COUNT) {
+        while (heap.sweepPage != NULL) {
+            Page* page = heap.sweepPage;
+            heap.sweepPage = page->next;
+            if (page->sweepEpoch != heap.sweepEpoch) return page;
         }
+        if (++heap.sweepClass < SIZE_CLASS_COUNT) heap.sweepPage = heap.classes[heap.sweepClass].pages;
     }
+    return NULL;
+}
+
+// trace from the remembered objects: in a minor collection the old ones
+// pointing to young objects, at the end of a full one the marked ones
+// stored into since they were marked.
+static void traceRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        if (isReached(vm.remembered[i])) blackenObject(vm.remembered[i]);
+    }
+    traceReferences();
+}
+
+// empty the remembered set. Every young object is promoted by the collection,
+// so no old object points to a young one after it.
+static void forgetRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
+
+// collect just the objects allocated since the last collection, in one go.
+static void collectYoung() {
+    vm.collectingYoung = true;
+    markRoots();
+    traceRemembered();
+    tableRemoveWhite(&vm.strings);
+    forgetRemembered();
+    sweepYoung();
+    vm.collectingYoung = false;
+}
+
+// finish marking in one go. Roots aren't behind the write barrier, so they
+// are marked again along with the objects stored into during marking.
+// Everything young then is swept with the old objects.
+static void finishMarking() {
+    markRoots();
+    traceRemembered();
+    tableRemoveWhite(&vm.strings);
+    // before sweeping, which may free remembered objects.
+    forgetRemembered();
+
+    // the sweep takes in the young objects too.
+    for (Page* page = heap.youngPages; page != NULL; page = page->nextYoung) {
+        page->isYoung = false;
+    }
+    heap.youngPages = NULL;
+    vm.youngBytes = 0;
+
+    heap.sweepEpoch++;
+    heap.sweepClass = 0;
+    heap.sweepPage = heap.classes[0].pages;
+    heap.sweepCredit = 0;
+    vm.gcPhase = GC_SWEEP;
 }
 
-// garbage collector. Uses mark and sweep algorithm.
+// run one slice of a full collection's marking, blackening gray objects
+// until the slice's work runs out.
+static void markSlice() {
+    if (vm.gcBudget <= 0) {
+        traceReferences();
+    } else {
+        for (int work = vm.gcBudget; vm.grayCount > 0; work--) {
+            if (work == 0) return;
+            blackenObject(vm.grayStack[--vm.grayCount]);
+        }
+    }
+    finishMarking();
+}
+
+// sweep a few pages. Called by allocations once a full collection has
+// marked, so the sweep is paid for a little at a time outside the pause.
+// Pages left empty are freed.
+static void sweepLazily() {
+    heap.sweepCredit += SWEEP_WORK;
+    while (heap.sweepCredit > 0) {
+        Page* page = nextUnsweptPage();
+        if (page == NULL) {
+            vm.gcPhase = GC_IDLE;
+            vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+            rewindAllocation();
+            return;
+        }
+
+        sweepPage(page);
+        heap.sweepCredit -= page->slotCount;
+        if (page->liveCount == 0 && page != heap.classes[page->sizeClass].current) freePage(page);
+    }
+}
+
+// wall clock time in seconds: pauses are what the program waits, whatever
+// threads the collector keeps busy meanwhile.
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// is it time to start a full collection? Stress runs start one whenever the
+// last has finished sweeping, and collect young objects while it sweeps.
+static bool fullCollectionDue() {
+#ifdef DEBUG_STRESS_GC
+    return true;
+#else
+    return vm.bytesAllocated > vm.nextGC;
+#endif
+}
+
+// garbage collector. Uses mark and sweep algorithm, over just the objects
+// allocated since the last collection (a minor collection) until the heap
+// has grown past nextGC, then over everything. Full collections mark in
+// slices of vm.gcBudget objects between allocations, so no one pause
+// traces the whole heap, and sweep lazily. Objects aren't moved, since the
+// interpreter and native code hold raw pointers to them.
 void collectGarbage() {
+    double start = now();
+    bool startFull = vm.gcPhase == GC_IDLE && fullCollectionDue();
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- gc begin (%s)\n", vm.gcPhase == GC_MARK || startFull ? "mark" : "minor");
     size_t before = vm.bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    if (startFull) {
+        // first, so the barrier sees the roots it marks as marked.
+        vm.gcPhase = GC_MARK;
+        markRoots();
+    }
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.gcPhase == GC_MARK) {
+        // marking takes in the young objects too, so minor collections wait for it.
+        markSlice();
+    } else {
+        // objects a pending sweep hasn't reached yet are marked, so a minor
+        // collection sees them as old.
+        collectYoung();
+    }
+    vm.sliceBytes = 0;
+
+    double pause = now() - start;
+    vm.gcPauses++;
+    vm.gcTotalPause += pause;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -239,13 +919,22 @@ void collectGarbage() {
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
-
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+        while (heap.classes[i].pages != NULL) {
+            Page* page = heap.classes[i].pages;
+            for (int word = 0; word * 64 < page->slotCount; word++) {
+                visitSlots(page, word, page->allocated[word], freeObject);
+            }
+            freePage(page);
+        }
     }
+    heap.youngPages = NULL;
 
     free(vm.grayStack);
+    free(vm.remembered);
+#ifdef PARALLEL_MARK
+    for (int i = 0; i < MARK_THREADS_MAX; i++) {
+        free(markWorkers[i].overflow);
+    }
+#endif
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
 (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -19,10 +20,40 @@ sizeof(type) * (newCount))
 #define FREE_ARRAY(type, pointer, oldCount) \
  reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// objects a full collection marks in each slice, unless set with
+// --gc-budget. Smaller slices mean shorter pauses but more of them. Stress
+// runs take tiny ones, so marking spans many allocations and stores.
+#ifdef DEBUG_STRESS_GC
+#define GC_SLICE_WORK 8
+#else
+#define GC_SLICE_WORK 1000
+#endif
+
+// bytes allocated between slices of a full collection.
+#define GC_SLICE_BYTES (16 * 1024)
+
+// the biggest object allocateSlot() takes. Every object type has to fit.
+#define SLOT_SIZE_MAX 256
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateSlot(size_t size);
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
 void freeObjects();
+void rememberObject(Obj* object);
+bool isMarkedObject(Obj* object);
+bool isReached(Obj* object);
+
+// call after storing a reference into an existing object. A minor collection
+// doesn't trace old objects, so it only finds the young objects they point
+// to through the ones remembered here. While a full collection is under way,
+// objects it has marked are remembered too. Marking traces them again before
+// it finishes, so nothing they were given is missed, and while it sweeps
+// they stand in for old objects to the minor collections.
+static inline void writeBarrier(Obj* object) {
+    if (object->isRemembered) return;
+    if (object->isOld || (vm.gcPhase != GC_IDLE && isMarkedObject(object))) rememberObject(object);
+}
 
 #endif
@@ -7,15 +7,16 @@
 #include "value.h"
 #include "vm.h"
 
+// allocate an object of a type. A type too big for the allocator's slots
+// fails to compile, as the array in the size check gets a negative size.
 #define ALLOCATE_OBJ(type, objectType) \
-(type*)allocateObject(sizeof(type), objectType)
+(type*)allocateObject(sizeof(type) + 0 * sizeof(char[sizeof(type) <= SLOT_SIZE_MAX ? 1 : -1]), objectType)
  
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateSlot(size);
     object->type = type;
-    object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isOld = false;
+    object->isRemembered = false;
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
 #endif
@@ -40,7 +41,10 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
-    initTable(&klass->methods);
+    klass->pages = NULL;
+    klass->pageCount = 0;
+    klass->initializer = NULL;
+    klass->fieldHint = 0;
     return klass;
 }
 
@@ -66,15 +70,26 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->traces = NULL;
+    function->traceCount = 0;
+    function->traceCapacity = 0;
     initChunk(&function->chunk);
     return function;
 }
 
 // initialize a new class instance.
 ObjInstance* newInstance(ObjClass* klass) {
+    // room for as many fields as the class's instances have had, allocated
+    // first so a collection can't catch the instance before it's returned.
+    Value* fields = ALLOCATE(Value, klass->fieldHint);
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.emptyShape;
+    instance->fields = fields;
+    instance->fieldCapacity = klass->fieldHint;
+    instance->bound = NULL;
     return instance;
 }
 
@@ -85,11 +100,131 @@ ObjNative* newNative(NativeFn function) {
     return native;
 }
 
+// initialize an instance layout with no fields.
+ObjShape* newShape() {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->fieldCount = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+// define or override a method, copying the page it lands in first if
+// another class shares it.
+// Arguments:
+//  klass - the class (must be reachable by the GC).
+//  slot - the method name's slot.
+//  method - the method (must be reachable by the GC).
+void setMethod(ObjClass* klass, int slot, ObjClosure* method) {
+    int index = slot / METHOD_PAGE_SIZE;
+    if (index >= klass->pageCount) {
+        int oldCount = klass->pageCount;
+        klass->pages = GROW_ARRAY(MethodPage*, klass->pages, oldCount, index + 1);
+        for (int i = oldCount; i <= index; i++) klass->pages[i] = NULL;
+        klass->pageCount = index + 1;
+    }
+
+    MethodPage* page = klass->pages[index];
+    if (page == NULL || page->refCount > 1) {
+        MethodPage* copy = ALLOCATE(MethodPage, 1);
+        if (page == NULL) {
+            memset(copy->methods, 0, sizeof(copy->methods));
+        } else {
+            memcpy(copy->methods, page->methods, sizeof(copy->methods));
+            page->refCount--;
+        }
+        copy->refCount = 1;
+        klass->pages[index] = copy;
+        page = copy;
+    }
+    page->methods[slot % METHOD_PAGE_SIZE] = method;
+    writeBarrier((Obj*)klass);
+}
+
+// give a class with no methods of its own all of its superclass's, by
+// sharing the superclass's pages. Its instances start out sized like the
+// superclass's, since they get at least the same fields.
+void inheritMethods(ObjClass* subclass, ObjClass* superclass) {
+    MethodPage** pages = ALLOCATE(MethodPage*, superclass->pageCount);
+    freeMethods(subclass);
+    for (int i = 0; i < superclass->pageCount; i++) {
+        pages[i] = superclass->pages[i];
+        if (pages[i] != NULL) pages[i]->refCount++;
+    }
+    subclass->pages = pages;
+    subclass->pageCount = superclass->pageCount;
+    subclass->initializer = superclass->initializer;
+    subclass->fieldHint = superclass->fieldHint;
+    writeBarrier((Obj*)subclass);
+}
+
+void freeMethods(ObjClass* klass) {
+    for (int i = 0; i < klass->pageCount; i++) {
+        MethodPage* page = klass->pages[i];
+        if (page != NULL && --page->refCount == 0) FREE(MethodPage, page);
+    }
+    FREE_ARRAY(MethodPage*, klass->pages, klass->pageCount);
+    klass->pages = NULL;
+    klass->pageCount = 0;
+}
+
+// find where a field lives in an instance layout.
+// Arguments:
+//  shape - the layout.
+//  name - the field name.
+// Returns: index into the instance's fields, or -1 if the layout doesn't have it.
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+// follow (creating if needed) the transition that appends a field to a layout.
+// Arguments:
+//  shape - the current layout.
+//  name - the field being added.
+// Returns: the layout with the field added.
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape();
+    push(OBJ_VAL(child));
+    tableAddAll(&shape->slots, &child->slots);
+    tableSet(&child->slots, name, NUMBER_VAL((double)shape->fieldCount));
+    child->fieldCount = shape->fieldCount + 1;
+    writeBarrier((Obj*)child);
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj*)shape);
+    pop();
+    return child;
+}
+
+// move an instance to the layout one transition further on, storing the new field.
+// Arguments:
+//  instance - the instance (must be reachable by the GC).
+//  shape - the layout after the transition (reachable through the instance's current layout).
+//  value - the value of the new field (must be reachable by the GC).
+void addField(ObjInstance* instance, ObjShape* shape, Value value) {
+    if (instance->fieldCapacity < shape->fieldCount) {
+        int oldCapacity = instance->fieldCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+        instance->fieldCapacity = capacity;
+    }
+
+    instance->fields[shape->fieldCount - 1] = value;
+    instance->shape = shape;
+    writeBarrier((Obj*)instance);
+    if (shape->fieldCount > instance->klass->fieldHint) instance->klass->fieldHint = shape->fieldCount;
+}
+
 static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    string->methodSlot = -1;
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
@@ -179,6 +314,10 @@ void printObject(Value value) {
             printf("<native fn>");
             break;
         }
+        case OBJ_SHAPE: {
+            printf("shape");
+            break;
+        }
         case OBJ_STRING: {
             printf("%s", AS_CSTRING(value));
             break;
@@ -27,6 +27,9 @@
 // is it a native function?
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 
+// is it an instance layout?
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
+
 // is it a string?
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
@@ -45,6 +48,9 @@
 // cast to a class instance
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 
+// cast to an instance layout.
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
+
 // cast to a native function object.
 #define AS_NATIVE(value) \
 (((ObjNative*)AS_OBJ(value))->function)
@@ -63,6 +69,7 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
@@ -71,8 +78,8 @@ typedef enum {
 // the other types, so a pointer to it can be used to reference the type.
 struct Obj {
     ObjType type;       // object type
-    bool isMarked;      // marked to retain in the garbage collection.
-    struct Obj* next;   // pointer to next object.
+    bool isOld;         // survived a collection, so only full collections look at it.
+    bool isRemembered;  // in the remembered set: old, or marked by a full collection in progress.
 };
 
 // a function.
@@ -82,6 +89,11 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    int hotness;                // calls plus loop backedges, to find functions worth compiling.
+    struct JitCode* jit;        // native code, or NULL while interpreted.
+    struct LoopTrace* traces;   // hot loops seen by the tracing JIT.
+    int traceCount;
+    int traceCapacity;
 } ObjFunction;
 
 // wrapper for a C native function to be imported into Lox (as a substitute for writing an actual library).
@@ -99,6 +111,7 @@ struct ObjString {
     int length;
     char* chars;
     uint32_t hash;
+    int methodSlot;     // index into every class's method table, -1 until a method has this name.
 };
 
 // an "upvalue" (variable enclosed for use in a closure or object method).
@@ -110,29 +123,57 @@ typedef struct ObjUpvalue {
 } ObjUpvalue;
 
 // structure for a closure.
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int upvalueCount;
 } ObjClosure;
 
-// structure for a class.
+// method slots in one page of a class's method table.
+#define METHOD_PAGE_SIZE 16
+
+// part of a method table. A subclass shares its superclass's pages, and
+// only copies one when it defines a method that lands in it.
 typedef struct {
+    int refCount;       // classes sharing this page.
+    struct ObjClosure* methods[METHOD_PAGE_SIZE];
+} MethodPage;
+
+// structure for a class. Methods live in a vtable-like array indexed by
+// the name's method slot, split into pages so inherited runs can be shared.
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;
-    Table methods;
+    MethodPage** pages; // method slot / METHOD_PAGE_SIZE -> page, NULL where the class has no methods.
+    int pageCount;
+    struct ObjClosure* initializer; // the "init" method, or NULL, so constructing skips the lookup.
+    int fieldHint;      // most fields an instance of the class has had, to size new instances.
 } ObjClass;
 
+// the layout ("hidden class") of an instance's fields.
+// Instances that added the same fields in the same order share one shape,
+// and keep only the field values themselves. Shapes form a transition tree
+// rooted at vm.emptyShape.
+typedef struct ObjShape {
+    Obj obj;
+    int fieldCount;     // number of fields in this layout.
+    Table slots;        // field name -> index into the instance's fields.
+    Table transitions;  // field name -> shape with that field appended.
+} ObjShape;
+
 // structure for a class instance.
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;    // layout of the fields array.
+    Value* fields;      // field values, in shape order.
+    int fieldCapacity;  // allocated size of fields.
+    ValueArray* bound;  // methods bound to this instance, handed out again for the same method. NULL until one is.
 } ObjInstance;
 
 // a method.
-typedef struct {
+typedef struct ObjBoundMethod {
     Obj obj;
     Value receiver;
     ObjClosure* method;
@@ -156,6 +197,27 @@ ObjInstance* newInstance(ObjClass* klass);
 // create a new representation for a native C function
 ObjNative* newNative( NativeFn function);
 
+// create a new empty instance layout.
+ObjShape* newShape();
+
+// define or override a method in a class's method table.
+void setMethod(ObjClass* klass, int slot, struct ObjClosure* method);
+
+// share a superclass's methods with a subclass that has none of its own yet.
+void inheritMethods(ObjClass* subclass, ObjClass* superclass);
+
+// release a class's method table.
+void freeMethods(ObjClass* klass);
+
+// find where a field lives in an instance layout (-1 if it has no such field).
+int shapeSlot(ObjShape* shape, ObjString* name);
+
+// get the layout that appends a field to another layout.
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name);
+
+// store a new field by moving an instance to the next layout.
+void addField(ObjInstance* instance, ObjShape* shape, Value value);
+
 ObjString* takeString(char* chars, int length);
 
 // copy a C string into a Value.
@@ -176,4 +238,17 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// look up a method by name.
+// Arguments:
+//  klass - the class.
+//  name - the method name.
+// Returns: the method, or NULL if the class has none by that name.
+static inline ObjClosure* findMethod(ObjClass* klass, ObjString* name) {
+    int slot = name->methodSlot;
+    if (slot == -1 || slot / METHOD_PAGE_SIZE >= klass->pageCount) return NULL;
+
+    MethodPage* page = klass->pages[slot / METHOD_PAGE_SIZE];
+    return page == NULL ? NULL : page->methods[slot % METHOD_PAGE_SIZE];
+}
+
 #endif
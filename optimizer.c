@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "optimizer.h"
+#include "memory.h"
+
+// flags kept for each byte of the chunk while it's being optimized.
+#define INSTRUCTION_START 0x01  // an instruction starts here
+#define JUMP_TARGET       0x02  // a reachable jump lands here
+#define REACHABLE         0x04  // control can get here
+#define REMOVED           0x08  // the instruction starting here is dropped
+
+// most jumps a chain is followed for when threading, so a cycle of jumps
+// can't hang the compiler.
+#define MAX_THREAD_HOPS 16
+
+// where the two-byte distance of a jump instruction is.
+// Returns: its offset from the start of the instruction, or 0 if the instruction isn't a jump.
+static int jumpOperand(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_LOOP:
+            return 1;
+        case OP_JUMP_IF_NOT_LESS_CONSTANT:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// where the jump instruction at offset lands.
+static int jumpDestination(Chunk* chunk, int offset) {
+    uint8_t* operand = &chunk->code[offset + jumpOperand(chunk->code[offset])];
+    int distance = (operand[0] << 8) | operand[1];
+    int end = offset + instructionLength(chunk, offset);
+
+    return chunk->code[offset] == OP_LOOP ? end - distance : end + distance;
+}
+
+// point the jump instruction at offset to a new destination. The caller
+// makes sure a forward jump goes forward and OP_LOOP goes back, and that
+// the distance fits in the operand.
+static void setJumpDestination(Chunk* chunk, int offset, int destination) {
+    uint8_t* operand = &chunk->code[offset + jumpOperand(chunk->code[offset])];
+    int end = offset + instructionLength(chunk, offset);
+    int distance = chunk->code[offset] == OP_LOOP ? end - destination : destination - end;
+    assert(distance >= 0 && distance <= UINT16_MAX);
+
+    operand[0] = (distance >> 8) & 0xff;
+    operand[1] = distance & 0xff;
+}
+
+// does an instruction only push a value, with no side effects or errors?
+static bool isPurePush(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a jump whose destination is another unconditional jump goes straight to
+// where that one goes. OP_JUMP turns into OP_LOOP if that's backwards. The
+// chain is only followed while the distance still fits in the operand.
+static void threadJump(Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset];
+    int end = offset + instructionLength(chunk, offset);
+    int destination = jumpDestination(chunk, offset);
+
+    for (int hops = 0; hops < MAX_THREAD_HOPS; hops++) {
+        uint8_t next = chunk->code[destination];
+        if ((next != OP_JUMP && next != OP_LOOP) || destination == offset) break;
+
+        int final = jumpDestination(chunk, destination);
+        if (final < end && instruction != OP_JUMP && instruction != OP_LOOP) {
+            break; // conditional jumps only go forward.
+        }
+        if ((final < end ? end - final : final - end) > UINT16_MAX) break;
+
+        if (instruction == OP_JUMP || instruction == OP_LOOP) {
+            instruction = final < end ? OP_LOOP : OP_JUMP;
+        }
+        destination = final;
+    }
+
+    chunk->code[offset] = instruction;
+    setJumpDestination(chunk, offset, destination);
+}
+
+// peephole optimize a finished chunk in place:
+//  - jumps to unconditional jumps are threaded to the final destination.
+//  - code that can't be reached (after OP_RETURN, OP_JUMP and OP_LOOP) is removed.
+//  - a jump to the instruction after it is removed.
+//  - a push that's immediately popped (like OP_NIL, OP_POP) is removed.
+// then the code and lines arrays are compacted, every jump distance is
+// recomputed, and both arrays are shrunk to fit.
+void optimizeChunk(Chunk* chunk) {
+    int count = chunk->count;
+    uint8_t* flags = ALLOCATE(uint8_t, count);
+    // every instruction pushes at most one offset onto the worklist, and only
+    // jumps, which are at least three bytes long, push two.
+    int* worklist = ALLOCATE(int, count + 1);
+    int* newOffset = ALLOCATE(int, count + 1);
+
+    for (int offset = 0; offset < count; offset++) flags[offset] = 0;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        flags[offset] |= INSTRUCTION_START;
+        if (jumpOperand(chunk->code[offset]) != 0) threadJump(chunk, offset);
+    }
+
+    // follow every path from the start to find the reachable instructions.
+    int pending = 0;
+    worklist[pending++] = 0;
+    while (pending > 0) {
+        int offset = worklist[--pending];
+        if (offset >= count || (flags[offset] & REACHABLE)) continue;
+        flags[offset] |= REACHABLE;
+
+        uint8_t instruction = chunk->code[offset];
+        if (jumpOperand(instruction) != 0) {
+            int destination = jumpDestination(chunk, offset);
+            flags[destination] |= JUMP_TARGET;
+            worklist[pending++] = destination;
+        }
+        if (instruction != OP_RETURN && instruction != OP_JUMP && instruction != OP_LOOP) {
+            worklist[pending++] = offset + instructionLength(chunk, offset);
+        }
+    }
+
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        if (!(flags[offset] & REACHABLE)) {
+            flags[offset] |= REMOVED;
+            continue;
+        }
+
+        uint8_t instruction = chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+
+        if (instruction == OP_JUMP) {
+            // jumps over nothing but dead code.
+            int destination = jumpDestination(chunk, offset);
+            int skipped = next;
+            while (skipped < destination && !(flags[skipped] & REACHABLE)) {
+                skipped += instructionLength(chunk, skipped);
+            }
+            if (skipped == destination) flags[offset] |= REMOVED;
+        } else if (isPurePush(instruction) && next < count && chunk->code[next] == OP_POP &&
+                   !(flags[next] & JUMP_TARGET)) {
+            flags[offset] |= REMOVED;
+            flags[next] |= REMOVED;
+            offset = next;
+        }
+    }
+
+    // removed instructions map to the next instruction that's kept.
+    int newCount = 0;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        int length = instructionLength(chunk, offset);
+        bool removed = flags[offset] & REMOVED;
+        for (int i = 0; i < length; i++) {
+            newOffset[offset + i] = removed ? newCount : newCount + i;
+        }
+        if (!removed) newCount += length;
+    }
+    newOffset[count] = newCount;
+
+    // instructions only move down, so copying them in order never overwrites
+    // one that hasn't been copied yet.
+    for (int offset = 0; offset < count;) {
+        int length = instructionLength(chunk, offset);
+        if (!(flags[offset] & REMOVED)) {
+            int to = newOffset[offset];
+            int destination = jumpOperand(chunk->code[offset]) != 0 ? jumpDestination(chunk, offset) : -1;
+
+            for (int i = 0; i < length; i++) {
+                chunk->code[to + i] = chunk->code[offset + i];
+                chunk->lines[to + i] = chunk->lines[offset + i];
+            }
+            if (destination != -1) setJumpDestination(chunk, to, newOffset[destination]);
+        }
+        offset += length;
+    }
+
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, newCount);
+    chunk->lines = GROW_ARRAY(int, chunk->lines, chunk->capacity, newCount);
+    chunk->capacity = newCount;
+    chunk->count = newCount;
+
+    FREE_ARRAY(int, newOffset, count + 1);
+    FREE_ARRAY(int, worklist, count + 1);
+    FREE_ARRAY(uint8_t, flags, count);
+}
@@ -59,6 +59,10 @@ void printValue(Value value) {
             printObject(value);
             break;
         }
+        case VAL_UNDEFINED: {
+            printf("undefined");
+            break;
+        }
     }
 #endif
 }
@@ -83,6 +87,7 @@ bool valuesEqual(Value a, Value b) {
         case VAL_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:
+        case VAL_UNDEFINED:
             return true;
         case VAL_NUMBER:
             return AS_NUMBER(a) == AS_NUMBER(b);
@@ -16,6 +16,8 @@ typedef struct ObjString ObjString;
 // other types.
 // 1. If the sign bit is set, then it's an Obj pointer.
 // 2. NIL, true and false use the low two bits for patterns.
+// 3. "undefined" (an unset global slot) uses the third bit. It never
+//    reaches Lox code.
 
 // the sign bit
 #define SIGN_BIT ((uint64_t) 0x8000000000000000)
@@ -27,11 +29,13 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE 3 // 11.
+#define TAG_UNDEFINED 4 // 100.
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
 (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -45,6 +49,7 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL( obj) \
 (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -68,6 +73,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,  // an unset global slot, never seen by Lox code.
 } ValueType;
 
 typedef struct {
@@ -84,6 +90,7 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 // macros to get the C value from the Lox value (unsafe without using the relevant IS_.. macro first)
 #define AS_BOOL(value) ((value).as.boolean)
@@ -95,6 +102,7 @@ typedef struct {
 #define NIL_VAL ((Value){ VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){ VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){ VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL ((Value){ VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -1,11 +1,13 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
@@ -35,8 +37,13 @@ static void runtimeError(const char* format, ...) {
     va_end(args);
     fputs("\n", stderr);
 
-    // next lines - print where it occurred and the call stack.
+    // next lines - print where it occurred and the call stack, skipping
+    // the middle of a deep one.
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+            fprintf(stderr, "... %d more frames ...\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES - 1;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
@@ -58,14 +65,64 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
+    pop();
     pop();
+}
+
+// find the slot of a global variable, allocating a new (undefined) one the
+// first time a name is seen. Called by the compiler, so slots are fixed
+// before any code referring to them runs.
+// Arguments: name - the global's name.
+// Returns: index into vm.globalValues.
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)index));
     pop();
+    return index;
+}
+
+// find the slot of a method name in every class's method table, allocating
+// the next one the first time a method is defined with that name.
+// Arguments: name - the method's name.
+// Returns: the name's method slot.
+int methodSlot(ObjString* name) {
+    if (name->methodSlot == -1) {
+        push(OBJ_VAL(name));
+        writeValueArray(&vm.methodNames, OBJ_VAL(name));
+        name->methodSlot = vm.methodNames.count - 1;
+        pop();
+    }
+    return name->methodSlot;
 }
 
 void initVM() {
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frames = malloc(sizeof(CallFrame) * vm.frameCapacity);
+    vm.stack = malloc(sizeof(Value) * vm.frameCapacity * FRAME_SLOTS);
+    if (vm.frames == NULL || vm.stack == NULL) exit(1);
     resetStack();
-    vm.objects = NULL;
+    vm.youngBytes = 0;
+    vm.collectingYoung = false;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.gcBudget = GC_SLICE_WORK;
+    vm.gcThreads = 0;
+    vm.sliceBytes = 0;
+    vm.gcPauses = 0;
+    vm.gcMaxPause = 0;
+    vm.gcTotalPause = 0;
 
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
@@ -74,20 +131,33 @@ void initVM() {
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
 
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.methodNames);
     initTable(&vm.strings);
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
+    vm.emptyShape = NULL;
+    vm.emptyShape = newShape();
+    vm.methodEpoch = 0;
+    vm.jitEnabled = true;
 
     // define native functions exposed to Lox.
     defineNative("clock", clockNative);
 } 
  
 void freeVM() {
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.methodNames);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.emptyShape = NULL;
     freeObjects();
+    free(vm.frames);
+    free(vm.stack);
 }
 
 // push an operand onto the stack.
@@ -109,6 +179,44 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+#ifdef JIT
+// count a call or loop backedge towards compiling a function to native code.
+static inline void countHotness(ObjFunction* function) {
+    if (function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD && vm.jitEnabled) {
+        compileJit(function);
+    }
+}
+#endif
+
+// double the frame and value stacks, up to FRAMES_MAX frames. Frames, open
+// upvalues and the stack top point into the value stack, so they are moved
+// along with it; run() reloads its copies with LOAD_FRAME after every call.
+// Returns: false if the stacks can't grow.
+static bool growStacks() {
+    if (vm.frameCapacity == FRAMES_MAX) return false;
+
+    int capacity = vm.frameCapacity * 2 < FRAMES_MAX ? vm.frameCapacity * 2 : FRAMES_MAX;
+    CallFrame* frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) return false;
+    vm.frames = frames;
+
+    Value* stack = realloc(vm.stack, sizeof(Value) * capacity * FRAME_SLOTS);
+    if (stack == NULL) return false;
+
+    if (stack != vm.stack) {
+        for (int i = 0; i < vm.frameCount; i++) {
+            vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+        }
+        for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+            upvalue->location = stack + (upvalue->location - vm.stack);
+        }
+        vm.stackTop = stack + (vm.stackTop - vm.stack);
+        vm.stack = stack;
+    }
+    vm.frameCapacity = capacity;
+    return true;
+}
+
 // the actual call to the function.
 // Arguments:
 //  function - the function.
@@ -119,7 +227,7 @@ static bool call( ObjClosure* closure, int argCount) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.frameCapacity && !growStacks()) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -128,6 +236,9 @@ static bool call( ObjClosure* closure, int argCount) {
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+#ifdef JIT
+    countHotness(closure->function);
+#endif
     return true;
 }
 
@@ -142,9 +253,8 @@ static bool callValue(Value callee, int argCount) {
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-                Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (klass->initializer != NULL) {
+                    return call(klass->initializer, argCount);
                 } else if (argCount != 0) {
                     runtimeError("Expected 0 arguments but got %d.", argCount);
                     return false;
@@ -170,38 +280,191 @@ static bool callValue(Value callee, int argCount) {
 }
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    ObjClosure* method = findMethod(klass, name);
+    if (method == NULL) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
+}
+
+// find the entry for an instance's shape and class in an inline cache.
+// Arguments:
+//  cache - the instruction's cache.
+//  instance - the receiver.
+// Returns: the entry, or NULL on a miss. A cache filled before a class's
+// methods last changed is emptied first.
+static inline CacheEntry* lookupCache(InlineCache* cache, ObjInstance* instance) {
+    if (cache->epoch != vm.methodEpoch) {
+        cache->epoch = vm.methodEpoch;
+        cache->count = 0;
+        return NULL;
+    }
+
+    for (int i = 0; i < cache->count; i++) {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape == instance->shape && entry->klass == instance->klass) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// remember a resolved entry in an inline cache.
+// Arguments:
+//  cache - the instruction's cache.
+//  entry - the freshly resolved entry.
+// Returns: the cached copy, or the entry itself once the site has seen too
+// many receiver types and gone megamorphic.
+static CacheEntry* updateCache(InlineCache* cache, CacheEntry* entry) {
+    if (cache->count == CACHE_MEGAMORPHIC) return entry;
+    if (cache->count == INLINE_CACHE_SIZE) {
+        cache->count = CACHE_MEGAMORPHIC;
+        return entry;
+    }
+
+    cache->entries[cache->count] = *entry;
+    writeBarrier((Obj*)vm.frames[vm.frameCount - 1].closure->function);
+    return &cache->entries[cache->count++];
+}
+
+// resolve a property read: fields shadow methods.
+// Arguments:
+//  instance - the receiver.
+//  name - the property name.
+//  entry - filled in with the field slot or the method.
+// Returns: false if the instance has no such field or method.
+static bool resolveProperty(ObjInstance* instance, ObjString* name, CacheEntry* entry) {
+    entry->shape = instance->shape;
+    entry->klass = instance->klass;
+    entry->target = instance->shape;
+    entry->slot = shapeSlot(instance->shape, name);
+    entry->method = NULL;
+    if (entry->slot != -1) return true;
+
+    entry->method = findMethod(instance->klass, name);
+    return entry->method != NULL;
+}
+
+// resolve a property store, following (or creating) the layout transition for a new field.
+// Arguments:
+//  instance - the receiver (must be reachable by the GC).
+//  name - the field name.
+//  entry - filled in with the slot and the layout after the store.
+static void resolveStore(ObjInstance* instance, ObjString* name, CacheEntry* entry) {
+    entry->shape = instance->shape;
+    entry->klass = instance->klass;
+    entry->method = NULL;
+    entry->slot = shapeSlot(instance->shape, name);
+    if (entry->slot != -1) {
+        entry->target = instance->shape;
+    } else {
+        entry->target = shapeTransition(instance->shape, name);
+        entry->slot = entry->target->fieldCount - 1;
+    }
+}
+
+// bind a method to the instance on top of the stack, replacing it. Bound
+// methods can't be changed, so an instance hands out the same one every
+// time a method is read from it, sparing an allocation per access.
+static void bindToInstance(ObjClosure* method) {
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+    if (instance->bound != NULL) {
+        for (int i = 0; i < instance->bound->count; i++) {
+            if (AS_BOUND_METHOD(instance->bound->values[i])->method == method) {
+                vm.stackTop[-1] = instance->bound->values[i];
+                return;
+            }
+        }
+    }
+
+    Value bound = OBJ_VAL(newBoundMethod(peek(0), method));
+    push(bound); // keep it from the collector while the array grows.
+    if (instance->bound == NULL) {
+        ValueArray* array = ALLOCATE(ValueArray, 1);
+        initValueArray(array);
+        instance->bound = array;
+    }
+    writeValueArray(instance->bound, bound);
+    writeBarrier((Obj*)instance);
+    pop();
+    pop(); // Instance.
+    push(bound);
+}
+
+// replace the instance on top of the stack with one of its properties.
+// Arguments:
+//  name - the property name.
+//  cache - the instruction's inline cache.
+// Returns: true if OK, false if runtime error.
+static inline bool getProperty(ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+
+    CacheEntry resolved;
+    CacheEntry* entry = lookupCache(cache, instance);
+    if (entry == NULL) {
+        if (!resolveProperty(instance, name, &resolved)) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        entry = updateCache(cache, &resolved);
+    }
+
+    // a field (shadows methods)
+    if (entry->slot != -1) {
+        pop(); // Instance.
+        push(instance->fields[entry->slot]);
+        return true;
+    }
+
+    // otherwise a method.
+    bindToInstance(entry->method);
+    return true;
 }
 
 // invoke a method (improved method)
-static bool invoke(ObjString* name, int argCount) {
+// Arguments:
+//  name - the method name.
+//  argCount - number of arguments.
+//  cache - the instruction's inline cache.
+static bool invoke(ObjString* name, int argCount, InlineCache* cache) {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instances have methods.");
         return false;
     }
     ObjInstance* instance = AS_INSTANCE(receiver);
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+
+    CacheEntry resolved;
+    CacheEntry* entry = lookupCache(cache, instance);
+    if (entry == NULL) {
+        if (!resolveProperty(instance, name, &resolved)) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        entry = updateCache(cache, &resolved);
+    }
+
+    if (entry->slot != -1) {
+        Value value = instance->fields[entry->slot];
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
-    return invokeFromClass(instance->klass, name, argCount);
+    return call(entry->method, argCount);
 }
 
 // bind a method when we're executing it.
 static bool bindMethod(ObjClass* klass, ObjString* name) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    ObjClosure* method = findMethod(klass, name);
+    if (method == NULL) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = newBoundMethod(peek(0), method);
     pop();
     push(OBJ_VAL(bound));
     return true;
@@ -240,15 +503,52 @@ static void closeUpvalues(Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue);
         vm.openUpvalues = upvalue->next;
     }
 }
 
+// call a value from tail position. A closure or bound method replaces the
+// current frame, closing its upvalues and moving the callee and arguments
+// down over its slots, so tail recursion runs in constant space. Anything
+// else is called normally and its result returned by the OP_RETURN after.
+static bool tailCallValue(Value callee, int argCount) {
+    ObjClosure* closure;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        vm.stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+        closure = AS_BOUND_METHOD(callee)->method;
+    } else {
+        return callValue(callee, argCount);
+    }
+
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+
+    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+#ifdef JIT
+    countHotness(closure->function);
+#endif
+    return true;
+}
+
 // define a class method for execution.
 static void defineMethod(ObjString* name) {
-    Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    setMethod(klass, methodSlot(name), AS_CLOSURE(peek(0)));
+    if (name == vm.initString) {
+        klass->initializer = AS_CLOSURE(peek(0));
+        writeBarrier((Obj*)klass);
+    }
+    vm.methodEpoch++;
     pop();
 }
 
@@ -276,37 +576,101 @@ static void concatenate() {
     push(OBJ_VAL(result));
 }
 
-// grab the next opcode and process it.
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-    
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
-    return run();
+// add two values for the three-address add instructions.
+// Arguments:
+//  a, b - the operands.
+//  result - where to put the sum or concatenation.
+// Returns: false if the operands can't be added.
+static inline bool addValues(Value a, Value b, Value* result) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        return true;
+    }
+    if (IS_STRING(a) && IS_STRING(b)) {
+        push(a);
+        push(b);
+        concatenate();
+        *result = pop();
+        return true;
+    }
+    return false;
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+// print the stack contents and the instruction we're about to interpret.
+// Arguments:
+//  frame - the frame that is executing.
+//  ip - the cached instruction pointer of that frame.
+static void traceInstruction(CallFrame* frame, uint8_t* ip) {
+    // print stack contents
+    printf(" ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    // print instruction we're going to interpret
+    disassembleInstruction(&frame->closure->function->chunk,
+        (int)(ip - frame->closure->function->chunk.code));
 }
+#endif
 
 // process an opcode.
 static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    
-    #define READ_BYTE() (*frame->ip++)
+    // the current frame's instruction pointer, slot base and constant table live
+    // in locals so the compiler can keep them in registers. frame->ip is only
+    // written back when something outside run() needs it (calls, errors).
+    CallFrame* frame;
+    register uint8_t* ip;
+    register Value* slots;
+    register Value* constants;
+    InlineCache* caches;
+
+    #define LOAD_FRAME() \
+    do { \
+    frame = &vm.frames[vm.frameCount - 1]; \
+    ip = frame->ip; \
+    slots = frame->slots; \
+    constants = frame->closure->function->chunk.constants.values; \
+    caches = frame->closure->function->chunk.caches; \
+    } while (false)
+
+    #define STORE_FRAME() (frame->ip = ip)
+
+    // run the frame's native code from ip, if the function has been compiled,
+    // and carry on interpreting wherever that code leaves off.
+    #ifdef JIT
+    #define ENTER_JIT() \
+    do { \
+    ObjFunction* function = frame->closure->function; \
+    if (function->jit != NULL) { \
+    ip = function->chunk.code + enterJit(function, (int)(ip - function->chunk.code), slots); \
+    } \
+    } while (false)
+    #else
+    #define ENTER_JIT() do { } while (false)
+    #endif
+
+    LOAD_FRAME();
+
+    #define READ_BYTE() (*ip++)
 
     #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-    #define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    #define READ_CONSTANT() (constants[READ_BYTE()])
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+    #define READ_CACHE() (&caches[READ_SHORT()])
+
     #define BINARY_OP(valueType, op) \
     do { \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+    STORE_FRAME(); \
     runtimeError("Operands must be numbers."); \
     return INTERPRET_RUNTIME_ERROR; \
     } \
@@ -315,299 +679,630 @@ static InterpretResult run() {
     push(valueType(a op b)); \
     } while (false)
 
-    for (;;) {
-        #ifdef DEBUG_TRACE_EXECUTION
-            // print stack contents
-            printf(" ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
+    // three-address arithmetic: store a op b straight into a local's slot.
+    #define REGISTER_OP(dst, a, op, b) \
+    do { \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+    STORE_FRAME(); \
+    runtimeError("Operands must be numbers."); \
+    return INTERPRET_RUNTIME_ERROR; \
+    } \
+    slots[dst] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+    // compare the two numbers on top of the stack and jump if the
+    // condition (written in terms of a and b) holds.
+    #define BRANCH_OP(jumpIf) \
+    do { \
+    uint16_t offset = READ_SHORT(); \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+    STORE_FRAME(); \
+    runtimeError("Operands must be numbers."); \
+    return INTERPRET_RUNTIME_ERROR; \
+    } \
+    double b = AS_NUMBER(pop()); \
+    double a = AS_NUMBER(pop()); \
+    if (jumpIf) ip += offset; \
+    } while (false)
+
+    #ifdef DEBUG_TRACE_EXECUTION
+    #define TRACE_INSTRUCTION() traceInstruction(frame, ip)
+    #else
+    #define TRACE_INSTRUCTION() do { } while (false)
+    #endif
+
+    #ifdef COMPUTED_GOTO
+    // direct threading: every handler ends by jumping straight to the handler
+    // of the next instruction, so each one gets its own indirect branch.
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&LABEL_OP_CONSTANT,
+        [OP_NIL] = &&LABEL_OP_NIL,
+        [OP_TRUE] = &&LABEL_OP_TRUE,
+        [OP_FALSE] = &&LABEL_OP_FALSE,
+        [OP_POP] = &&LABEL_OP_POP,
+        [OP_GET_LOCAL] = &&LABEL_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&LABEL_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&LABEL_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&LABEL_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&LABEL_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&LABEL_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&LABEL_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&LABEL_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&LABEL_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&LABEL_OP_GET_SUPER,
+        [OP_EQUAL] = &&LABEL_OP_EQUAL,
+        [OP_GREATER] = &&LABEL_OP_GREATER,
+        [OP_LESS] = &&LABEL_OP_LESS,
+        [OP_ADD] = &&LABEL_OP_ADD,
+        [OP_ADD_NUMBER] = &&LABEL_OP_ADD_NUMBER,
+        [OP_ADD_STRING] = &&LABEL_OP_ADD_STRING,
+        [OP_ADD_GENERIC] = &&LABEL_OP_ADD_GENERIC,
+        [OP_SUBTRACT] = &&LABEL_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&LABEL_OP_MULTIPLY,
+        [OP_DIVIDE] = &&LABEL_OP_DIVIDE,
+        [OP_NOT] = &&LABEL_OP_NOT,
+        [OP_NEGATE] = &&LABEL_OP_NEGATE,
+        [OP_PRINT] = &&LABEL_OP_PRINT,
+        [OP_JUMP] = &&LABEL_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&LABEL_OP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_NOT_LESS] = &&LABEL_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&LABEL_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&LABEL_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&LABEL_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_LOOP] = &&LABEL_OP_LOOP,
+        [OP_CALL] = &&LABEL_OP_CALL,
+        [OP_TAIL_CALL] = &&LABEL_OP_TAIL_CALL,
+        [OP_INVOKE] = &&LABEL_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&LABEL_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&LABEL_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&LABEL_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&LABEL_OP_RETURN,
+        [OP_CLASS] = &&LABEL_OP_CLASS,
+        [OP_INHERIT] = &&LABEL_OP_INHERIT,
+        [OP_METHOD] = &&LABEL_OP_METHOD,
+        [OP_ADD_LOCALS] = &&LABEL_OP_ADD_LOCALS,
+        [OP_GET_LOCAL_PROPERTY] = &&LABEL_OP_GET_LOCAL_PROPERTY,
+        [OP_JUMP_IF_NOT_LESS_CONSTANT] = &&LABEL_OP_JUMP_IF_NOT_LESS_CONSTANT,
+        [OP_ADD_RR] = &&LABEL_OP_ADD_RR,
+        [OP_SUBTRACT_RR] = &&LABEL_OP_SUBTRACT_RR,
+        [OP_MULTIPLY_RR] = &&LABEL_OP_MULTIPLY_RR,
+        [OP_DIVIDE_RR] = &&LABEL_OP_DIVIDE_RR,
+        [OP_ADD_RK] = &&LABEL_OP_ADD_RK,
+        [OP_SUBTRACT_RK] = &&LABEL_OP_SUBTRACT_RK,
+        [OP_MULTIPLY_RK] = &&LABEL_OP_MULTIPLY_RK,
+        [OP_DIVIDE_RK] = &&LABEL_OP_DIVIDE_RK,
+    };
+
+    #define INTERPRET_LOOP DISPATCH();
+    #define CASE(op) LABEL_##op
+    #define DISPATCH() \
+    do { \
+    TRACE_INSTRUCTION(); \
+    goto *dispatchTable[instruction = READ_BYTE()]; \
+    } while (false)
+    #else
+    // portable fallback: a single switch shared by every instruction.
+    #define INTERPRET_LOOP \
+    loop: \
+    TRACE_INSTRUCTION(); \
+    switch (instruction = READ_BYTE())
+    #define CASE(op) case op
+    #define DISPATCH() goto loop
+    #endif
+
+    // interpret the instructions
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): {
+            push(NIL_VAL);
+            DISPATCH();
+        }
+        CASE(OP_TRUE): {
+            push(BOOL_VAL(true));
+            DISPATCH();
+        }
+        CASE(OP_FALSE): {
+            push(BOOL_VAL(false));
+            DISPATCH();
+        }
+        CASE(OP_POP): {
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            push(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
             }
-            printf("\n");
-            
-            // print instruction we're going to interpret
-            disassembleInstruction(&frame->closure->function->chunk, 
-                (int)(frame->ip - frame->closure->function->chunk.code));
-        #endif
-
-        // interpret the instruction
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: {
-                push(NIL_VAL);
-                break;
-            }
-            case OP_TRUE: {
-                push(BOOL_VAL(true));
-                break;
-            }
-            case OP_FALSE: {
-                push(BOOL_VAL(false));
-                break;
-            }
-            case OP_POP: {
-                pop();
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                push(value);
-                break;
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = peek(0);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                STORE_FRAME();
+                runtimeError("Undefined variable '% s'.", AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '% s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
-            }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
-            }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
+            vm.globalValues.values[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = peek(0);
+            writeBarrier((Obj*)upvalue);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!getProperty(name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            if (!IS_INSTANCE(peek(1))) {
+                STORE_FRAME();
+                runtimeError("Only instances have fields.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
 
-                // look for a field (shadows methods)
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
+            ObjInstance* instance = AS_INSTANCE(peek(1));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
 
-                // field not found, look for method.
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            CacheEntry resolved;
+            CacheEntry* entry = lookupCache(cache, instance);
+            if (entry == NULL) {
+                resolveStore(instance, name, &resolved);
+                entry = updateCache(cache, &resolved);
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
-            }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: {
-                BINARY_OP(BOOL_VAL, >);
-                break;
-            }
-            case OP_LESS: {
-                BINARY_OP(BOOL_VAL, <);
-                break;
-            }
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            if (entry->target == instance->shape) {
+                instance->fields[entry->slot] = peek(0);
+                writeBarrier((Obj*)instance);
+            } else {
+                addField(instance, entry->target, peek(0));
             }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
-                break;
+            Value value = pop();
+            pop();
+            push(value);
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop());
+            STORE_FRAME();
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): {
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS): {
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_ADD): {
+            // quicken the site to the variant for the operand types seen,
+            // so later executions skip the type dispatch.
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                ip[-1] = OP_ADD_STRING;
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                ip[-1] = OP_ADD_NUMBER;
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                STORE_FRAME();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VAL, /);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUMBER): {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                // deoptimize for good: the site has seen mixed types.
+                ip[-1] = OP_ADD_GENERIC;
+                ip--;
+                DISPATCH();
             }
-            case OP_NOT: {
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        CASE(OP_ADD_STRING): {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                // deoptimize for good: the site has seen mixed types.
+                ip[-1] = OP_ADD_GENERIC;
+                ip--;
+                DISPATCH();
             }
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+            concatenate();
+            DISPATCH();
+        }
+        CASE(OP_ADD_GENERIC): {
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                concatenate();
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                double b = AS_NUMBER(pop());
+                double a = AS_NUMBER(pop());
+                push(NUMBER_VAL(a + b));
+            } else {
+                STORE_FRAME();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): {
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY): {
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE): {
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        }
+        CASE(OP_NOT): {
+            push(BOOL_VAL(isFalsey(pop())));
+            DISPATCH();
+        }
+        CASE(OP_NEGATE): {
+            if (!IS_NUMBER(peek(0))) {
+                STORE_FRAME();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            printValue(pop());
+            printf("\n");
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0))) {
+                ip += offset;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) {
-                    frame->ip += offset;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS): {
+            BRANCH_OP(!(a < b));
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS_EQUAL): {
+            BRANCH_OP(a > b);
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER): {
+            BRANCH_OP(!(a > b));
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER_EQUAL): {
+            BRANCH_OP(a < b);
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+#ifdef JIT
+            ObjFunction* function = frame->closure->function;
+            if (vm.jitEnabled) {
+                ip = function->chunk.code + traceLoop(function, (int)(ip - function->chunk.code), slots);
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            countHotness(function);
+#endif
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            LOAD_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!tailCallValue(peek(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
 
-                break;
+            LOAD_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            }
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK; // return from global level exits interpreter.
+            LOAD_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            ObjClass* superclass = AS_CLASS(pop());
+            STORE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            LOAD_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure* closure = newClosure(function);
+            push(OBJ_VAL(closure));
+            
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
+            }
+            // captureUpvalue() may have promoted the closure.
+            writeBarrier((Obj*)closure);
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE): {
+            closeUpvalues(vm.stackTop - 1);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_RETURN): {
+            Value result = pop();
+            closeUpvalues(slots);
+            vm.frameCount--;
+            if (vm.frameCount == 0) {
+                pop();
+                return INTERPRET_OK; // return from global level exits interpreter.
+            }
+
+            vm.stackTop = slots;
+            push(result);
+            LOAD_FRAME();
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            push(OBJ_VAL(newClass(READ_STRING())));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+                STORE_FRAME();
+                runtimeError("Superclass must be a class.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjClass* subclass = AS_CLASS(peek(0));
+            inheritMethods(subclass, AS_CLASS(superclass));
+            vm.methodEpoch++;
+            pop(); // Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            defineMethod(READ_STRING());
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
             }
-            case OP_METHOD: {
-                defineMethod(READ_STRING());
-                break;
+
+            push(a);
+            push(b);
+            if (IS_STRING(a) && IS_STRING(b)) {
+                concatenate();
+                DISPATCH();
+            }
+            STORE_FRAME();
+            runtimeError("Operands must be two numbers or two strings.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        CASE(OP_GET_LOCAL_PROPERTY): {
+            push(slots[READ_BYTE()]);
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!getProperty(name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS_CONSTANT): {
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(b)) {
+                push(b); // report the error with both operands in place.
+                STORE_FRAME();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+
+            double a = AS_NUMBER(pop());
+            if (!(a < AS_NUMBER(b))) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_RR): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            Value result;
+            if (!addValues(a, b, &result)) {
+                STORE_FRAME();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[dst] = result;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_RR): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            REGISTER_OP(dst, a, -, b);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_RR): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            REGISTER_OP(dst, a, *, b);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_RR): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            REGISTER_OP(dst, a, /, b);
+            DISPATCH();
+        }
+        CASE(OP_ADD_RK): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            Value result;
+            if (!addValues(a, b, &result)) {
+                STORE_FRAME();
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
+            slots[dst] = result;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_RK): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            REGISTER_OP(dst, a, -, b);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY_RK): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            REGISTER_OP(dst, a, *, b);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE_RK): {
+            uint8_t dst = READ_BYTE();
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            REGISTER_OP(dst, a, /, b);
+            DISPATCH();
         }
     }
 
+    return INTERPRET_RUNTIME_ERROR; // Unreachable.
+
+    #undef LOAD_FRAME
+    #undef STORE_FRAME
+    #undef ENTER_JIT
     #undef READ_BYTE
     #undef READ_SHORT
     #undef READ_CONSTANT
     #undef READ_STRING
+    #undef READ_CACHE
     #undef BINARY_OP
+    #undef REGISTER_OP
+    #undef BRANCH_OP
+    #undef TRACE_INSTRUCTION
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DISPATCH
+}
+
+// grab the next opcode and process it.
+InterpretResult interpret(const char* source) {
+    ObjFunction* function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    
+    push(OBJ_VAL(function));
+    ObjClosure* closure = newClosure(function);
+    pop();
+    push(OBJ_VAL(closure));
+    call(closure, 0);
+    return run();
 }
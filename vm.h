@@ -5,8 +5,21 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// call depth the frame and value stacks start out sized for. Both double
+// when a call needs more.
+#define FRAMES_INITIAL 64
+
+// deepest call before "Stack overflow.". Build with -DFRAMES_MAX=n to change it.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
+
+// frames a runtime error's stack trace prints at each end. Those in
+// between are only counted.
+#define TRACE_FRAMES 32
+
+// value stack slots set aside for each frame: its locals and temporaries.
+#define FRAME_SLOTS UINT8_COUNT
 
 typedef struct {
     ObjClosure* closure;
@@ -14,19 +27,48 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// where a full collection is. Between slices of one the program runs on,
+// with the write barrier keeping marked objects from gaining unmarked
+// references unseen.
+typedef enum {
+    GC_IDLE,
+    GC_MARK,            // tracing the gray objects.
+    GC_SWEEP,           // freeing what wasn't marked, a little at each allocation.
+} GcPhase;
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;          // the value stack holds frameCapacity * FRAME_SLOTS values.
     
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    Table globalSlots;          // global name -> index into globalValues.
+    ValueArray globalValues;    // global values, UNDEFINED_VAL until defined.
+    ValueArray globalNames;     // global names, for error messages.
+    ValueArray methodNames;     // method slot -> name, keeping the names (and so their slots) alive.
     Table strings;
     ObjString* initString;
+    ObjShape* emptyShape;       // root of the instance layout transition tree.
+    uint32_t methodEpoch;       // bumped when any class's methods change, flushing inline caches.
+    bool jitEnabled;            // compile hot functions to native code (off with --no-jit).
     ObjUpvalue* openUpvalues;
     size_t bytesAllocated;
     size_t nextGC;
-    Obj* objects;
+    size_t youngBytes;          // allocated since the last collection.
+    bool collectingYoung;       // a minor collection is running.
+
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;           // old objects that may reference young ones.
+
+    GcPhase gcPhase;
+    int gcBudget;               // objects marked per slice, 0 to mark in one pause.
+    int gcThreads;              // threads marking a large heap, 0 for one per core.
+    size_t sliceBytes;          // allocated since the last slice.
+    int gcPauses;               // collections and slices run.
+    double gcMaxPause;          // longest of them, in seconds.
+    double gcTotalPause;
 
     int grayCount;
     int grayCapacity;
@@ -44,6 +86,8 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+int globalSlot(ObjString* name);
+int methodSlot(ObjString* name);
 void push(Value value);
 Value pop();
 